@@ -0,0 +1,461 @@
+#ifndef ASF_FILE_HPP
+#define ASF_FILE_HPP
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <glm/glm.hpp>
+#include "dof_decoder.hpp"
+#include "mapped_file.hpp"
+#include "mapped_reader.hpp"
+#include "skeleton.hpp"
+
+// CMU ASF/AMC lengths are in units of 1/0.45 inch; this turns them
+// into meters.
+template <typename T>
+T amc2meter(T t) {
+  return t * 0.056444f;
+}
+
+// The contents of an ASF skeleton file: its bones, as a Skeleton, and
+// the :units and :root entries the AMC channels are read against.
+// Nothing here draws, so tools that only need the skeleton (the clip
+// packer, benchmarks) do not depend on GL.
+class AsfFile {
+public:
+    AsfFile();
+
+    // Parses asfFilename; aborts on anything it does not understand.
+    // A file that cannot be opened gives an empty skeleton.
+    void load(std::string asfFilename);
+
+    // The finished skeleton; it never changes once load() returns.
+    std::shared_ptr<const Skeleton> getSkeleton() const { return skeleton; }
+    bool usesDegrees() const { return deg; }
+    glm::vec3 getRootPosition() const { return rootPosition; }       // meters
+    glm::vec3 getRootOrientation() const { return rootOrientation; }
+
+protected:
+    // The parsers work with either a Reader or a MappedReader.
+    template <typename R> void parseUnits(R &r);
+    template <typename R> void parseRoot(R &r);
+    template <typename R> void parseBonedata(R &r);
+    template <typename R> void parseHierarchy(R &r);
+    std::shared_ptr<Skeleton> skeleton;
+    bool deg;
+    glm::vec3 rootPosition, rootOrientation;
+};
+
+// This class just provides a data structure to store information
+// about how each bone can move, including whether it can rotate in
+// the x, y, and z directions (some joints support rotation along all
+// axes, others are just 1-dimensional) and the min and max angles of
+// rotation for each axis.
+class RotationBounds {
+public:
+    RotationBounds();  
+    void setdof(bool rx, bool ry, bool rz);
+    void setR(int index, float min, float max);
+    bool dofRX;
+    bool dofRY;
+    bool dofRZ;
+    int dofs;
+    float minRX;
+    float maxRX;
+    float minRY;
+    float maxRY;
+    float minRZ;
+    float maxRZ;
+};
+
+// One bone as read from the :bonedata section of an ASF file. Once
+// read, it is added to the AsfFile's Skeleton, which is what a
+// character is posed and drawn with.
+class Bone {
+public:
+
+    // This constructor is setup to read data from the CMU motion
+    // capture database files.
+    template <typename R> Bone(R &r, bool deg);
+
+    // Bones are named based on parts of the body
+    std::string getName();    
+
+    // The bone as the Skeleton keeps it.
+    Skeleton::BoneInfo getInfo();
+
+    int getId() { return id; }
+    glm::vec3 getDirection() { return direction; }
+    float getLength() { return length; }
+    glm::vec3 getAxis() { return axis; }
+    RotationBounds getRotationBounds() { return rotationBounds; }
+    int getDofs() { return rotationBounds.dofs; }
+protected:
+    //TaperedCylinder *cylinder;
+    template <typename R> void constructFromFile(R &r, bool deg);
+    // float deg2rad(float d);
+    std::string name;
+    float length;
+    glm::vec3 direction;
+    RotationBounds rotationBounds;    
+    glm::vec3 axis;
+    int id;
+    bool deg;
+};
+
+// Definitions below
+
+inline AsfFile::AsfFile()
+    : deg(false), rootPosition(0, 0, 0), rootOrientation(0, 0, 0) {
+}
+
+inline void AsfFile::load(std::string asfFilename) {
+    skeleton.reset(new Skeleton);
+    deg = false;
+    rootPosition = rootOrientation = glm::vec3(0, 0, 0);
+    MappedFile file;
+    file.open(asfFilename);
+    MappedReader r(file);
+    while (r.good()) {
+        if (r.expect("#")) {
+            std::cerr << "Ignoring comment line" << std::endl;
+            r.swallowLine();
+        }    
+        else if (r.expect(":version")) {
+            r.swallowLine();
+        }    
+        else if (r.expect(":name")) {
+            std::cerr << "Swallowing name" << std::endl;
+            r.swallowLine();
+        }    
+        else if (r.expect(":units")) {
+            std::cerr << "Reading units" << std::endl;
+            parseUnits(r);
+        }    
+        else if (r.expect(":documentation")) {
+            std::cerr << "Reading documentation" << std::endl;
+            while (r.good() && !r.peek(":")) {
+                r.swallowLine();
+            }
+        }    
+        else if (r.expect(":root")) {
+            std::cerr << "Reading root" << std::endl;
+            parseRoot(r);
+        }    
+        else if (r.expect(":bonedata")) {
+            std::cerr << "Reading bonedata" << std::endl;
+            parseBonedata(r);
+        }    
+        else if (r.expect(":hierarchy")) {
+            std::cerr << "Reading hierarchy" << std::endl;
+            parseHierarchy(r);
+        }    
+        else {      
+            std::string tok;
+            r.readToken(tok);
+            if (!r.good()) {
+                break;
+            }
+            std::cerr << "Encountered unknown token" << std::endl;
+            std::cerr << "'" << tok << "'" << std::endl;
+            std::abort();
+        }
+    } // end while (looping over file) 
+    skeleton->finish();
+}
+
+template <typename R>
+inline void AsfFile::parseUnits(R &r) {
+    bool cont;
+    do {
+        cont = false;    
+        if (r.expect("mass")) {
+            float trash;
+            r.readFloat(trash);
+            cont = true;
+        }    
+        if (r.expect("length")) {
+            float trash;
+            r.readFloat(trash);
+            cont = true;
+        }    
+        if (r.expect("angle")) {
+            std::string token;
+            r.readToken(token);
+            if (token == "deg") {
+                deg = true;
+            }
+        }    
+    } while (cont);
+}
+
+template <typename R>
+inline void AsfFile::parseRoot(R &r) {
+    bool cont;
+    do {
+        cont = false;    
+        if (r.expect("order")) {
+            cont = true;
+            if (!r.expect("TX TY TZ RX RY RZ")) {
+                std::cerr << "'order' not in order expected" << std::endl;
+                std::abort();
+            }
+        }    
+        if (r.expect("axis")) {
+            cont = true;
+            if (!r.expect("XYZ")) {
+                std::cerr << "'axis' not in order expected" << std::endl;
+                std::abort();
+            }
+        }    
+        if (r.expect("position")) {
+            cont = true;
+            r.readFloat(rootPosition.x);
+            r.readFloat(rootPosition.y);
+            r.readFloat(rootPosition.z);
+            rootPosition = amc2meter(rootPosition);
+        }    
+        if (r.expect("orientation")) {
+            cont = true;
+            r.readFloat(rootOrientation.x);
+            r.readFloat(rootOrientation.y);
+            r.readFloat(rootOrientation.z);
+        }    
+    } while (cont);
+}
+
+template <typename R>
+inline void AsfFile::parseBonedata(R &r) {
+    while (r.expect("begin")) {
+        Bone bone(r, deg);
+        RotationBounds bounds = bone.getRotationBounds();
+        int dofMask = (bounds.dofRX ? 1 : 0) | (bounds.dofRY ? 2 : 0) | (bounds.dofRZ ? 4 : 0);
+        float limits[6] = {bounds.minRX, bounds.maxRX, bounds.minRY, bounds.maxRY,
+                           bounds.minRZ, bounds.maxRZ};
+        skeleton->addBone(bone.getInfo(), dofMask, limits);
+    }
+}
+
+template <typename R>
+inline void AsfFile::parseHierarchy(R &r) {
+    if (!r.expect("begin")) {
+        std::cerr << "Reading hierarchy, expected 'begin', not found" << std::endl;
+        std::abort();
+    }
+    while (!r.expect("end")) {
+        std::string line;
+        std::string parent;
+        r.readToken(parent);
+        r.readLine(line);    
+        std::stringstream ss(line);
+        std::string child;
+        ss >> child;
+        int p = (parent == "root") ? -1 : skeleton->findBone(parent);
+        while (ss) {
+            int c = skeleton->findBone(child);
+            if (c < 0 || (p < 0 && parent != "root")) {
+                std::cerr << "Hierarchy names unknown bone '"
+                          << (c < 0 ? child : parent) << "'" << std::endl;
+                std::abort();
+            }
+            skeleton->addLink(p, c);
+            ss >> child;
+        }
+    }
+}
+
+template <typename R>
+inline Bone::Bone(R &r, bool deg) {
+    constructFromFile(r, deg);
+}
+
+inline RotationBounds::RotationBounds() {
+    dofRX = false;
+    dofRY = false;
+    dofRZ = false;
+    minRX = 0;
+    maxRX = 0;
+    minRY = 0;
+    maxRY = 0;
+    minRZ = 0;
+    maxRZ = 0;
+    dofs = 0;
+}
+
+inline void RotationBounds::setdof(bool rx, bool ry, bool rz) {
+    dofRX = rx;
+    dofRY = ry;
+    dofRZ = rz;
+    dofs = rx + ry + rz;
+}
+
+inline void RotationBounds::setR(int index, float min, float max) {
+    int mask = (dofRX ? 1 : 0) | (dofRY ? 2 : 0) | (dofRZ ? 4 : 0);
+    float *bounds[3][2] = {{&minRX, &maxRX}, {&minRY, &maxRY}, {&minRZ, &maxRZ}};
+    int axis = dofAxis(mask, index);
+    if (axis < 0) {
+        std::abort(); // The bone has no dof with that index.
+    }
+    *bounds[axis][0] = min;
+    *bounds[axis][1] = max;
+}
+
+const bool ABORT_ON_ERROR=true;
+
+inline void assume(bool b) {
+    if (!b && ABORT_ON_ERROR) {
+        std::abort();
+    }
+}
+
+template <typename R>
+inline void Bone::constructFromFile(R &r, bool deg) {
+    this->deg = deg;
+    while (!r.expect("end")) {    
+        if (r.expect("id")) {
+            r.readInt(id);      
+        }    
+        if (r.expect("name")) {
+            r.readToken(name);
+        }    
+        if (r.expect("direction")) {
+            r.readFloat(direction.x);
+            r.readFloat(direction.y);
+            r.readFloat(direction.z);
+        }    
+        if (r.expect("length")) {
+            r.readFloat(length);
+            length = amc2meter(length);
+        }    
+        if (r.expect("axis")) {
+            float ax, ay, az;
+            std::string axisType;
+            r.readFloat(ax);
+            r.readFloat(ay);
+            r.readFloat(az);
+            r.readToken(axisType);
+            axis = glm::vec3(ax, ay, az);
+            if (axisType != "XYZ") {
+                std::abort();
+            }      
+        }    
+        if (r.expect("dof")) {
+            bool rx, ry, rz;
+            rx = r.expect("rx");
+            ry = r.expect("ry");
+            rz = r.expect("rz");
+            rotationBounds.setdof(rx, ry, rz);
+        }    
+        if (r.expect("limits")) {
+            for (int dof=0; dof<rotationBounds.dofs; dof++) {
+                assume(r.expect("("));
+                float min, max;
+                r.readFloat(min);
+                r.readFloat(max);
+                assume(r.expect(")"));
+                rotationBounds.setR(dof, min, max);
+            }
+        }    
+    } // read "end" token  
+    glm::vec3 skin(0.8, 0.7, 0.4);
+    glm::vec3 shirt(1.0, 0.07, 0.57);
+    glm::vec3 pants(0.19, 0.31, 0.31);
+    glm::vec3 shoes(0.9, 0.9, 0.8);  
+    float r1=0.02, r2=0.01;
+    glm::vec3 c1 = glm::vec3(1,1,1), c2 = glm::vec3(1,1,1);
+    if (name == "lhipjoint" || name == "rhipjoint") {
+        r1 = 0.09;
+        r2 = 0.05;
+        c1 = pants;
+        c2 = pants;
+    }
+    if (name == "lfemur" || name == "rfemur") {
+        r1 = 0.05;
+        r2 = 0.05;
+        c1 = pants;
+        c2 = pants;
+    }
+    if (name == "ltibia" || name == "rtibia") {
+        r1 = 0.05;
+        r2 = 0.04;
+        c1 = pants;
+        c2 = pants;
+    } 
+    if (name == "lfoot" || name == "rfoot") {
+        r1 = 0.06;
+        r2 = 0.05;
+        c1 = shoes;
+        c2 = shoes;
+    }
+    if (name == "ltoes" || name == "rtoes") {
+        r1 = 0.05;
+        r2 = 0.03;
+        c1 = shoes;
+        c2 = shoes;
+    }
+    if (name == "lowerback" || name == "upperback" || name == "thorax") {
+        r1 = 0.10;
+        r2 = 0.10;
+        c1 = shirt;
+        c2 = shirt;
+    }
+    if (name == "lowerback") {
+        r1 = 0.08;
+    }
+    if (name == "lowerneck" || name == "upperneck") {
+        r1 = 0.04;
+        r2 = 0.04;
+        c1 = skin;
+        c2 = skin;
+    }
+    if (name == "head") {
+        r1 = 0.06;
+        r2 = 0.08;
+        c1 = skin;
+        c2 = skin;
+    }
+    if (name == "lclavicle" || name == "rclavicle") {
+        r1 = 0.05;
+        r2 = 0.05;
+        c1 = shirt;
+        c2 = shirt;
+    }
+    if (name == "lhumerus" || name == "rhumerus" || name == "lradius" || name == "rradius") {
+        r1 = 0.03;
+        r2 = 0.025;
+        c1 = skin;
+        c2 = skin;
+    }
+    if (name == "lwrist" || name == "rwrist") {
+        r1 = 0.025;
+        r2 = 0.02;
+        c1 = skin;
+        c2 = skin;
+    }
+    if (name == "lhand" || name == "rhand" || name == "lthumb" || name == "rthumb" || name == "rfingers" || name == "lfingers") {
+        r1 = 0.025;
+        r2 = 0.02;
+        c1 = skin;
+        c2 = skin;
+    }
+    //cylinder = new TaperedCylinder(length, r1, r2, c1, c2);
+}
+
+inline std::string Bone::getName() {
+    return name;
+}
+
+inline Skeleton::BoneInfo Bone::getInfo() {
+    Skeleton::BoneInfo info;
+    info.name = name;
+    info.id = id;
+    info.direction = direction;
+    info.length = length;
+    info.axis = axis;
+    info.asfIndex = -1;
+    return info;
+}
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef BUFFERED_CLIP_HPP
+#define BUFFERED_CLIP_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "frame_source.hpp"
+#include "streamed_clip.hpp"
+
+// Plays a StreamedClip through a fixed-size ring buffer that a
+// background thread keeps filled with the frames ahead of the
+// playhead, so the render thread never waits for the disk.
+//
+// The ring holds a run of consecutive frames (forwards or backwards,
+// wrapping around the end of the clip): up to readAhead of them ahead
+// of the playhead, and as many already-played ones behind it as still
+// fit. Memory use is capacity frames regardless of the clip length.
+//
+// When a requested frame is not in the ring (an underrun: a seek, a
+// change of direction, or a disk that cannot keep up), frame() returns
+// the last frame it delivered instead of blocking, and the producer
+// restarts from the requested frame. Underruns are counted so the
+// buffer can be sized for each machine.
+class BufferedClip : public FrameSource {
+public:
+    struct Stats {
+        // frame() calls for anything but the frame it returned last;
+        // a frame that underran is counted again each time it is asked
+        // for until the ring has it.
+        int requests;
+        int underruns;      // requests the ring could not serve
+        int framesDecoded;  // by the producer thread
+    };
+
+    // Takes ownership of an opened StreamedClip; from now on only the
+    // producer thread reads from it. readAhead is limited to
+    // capacity - 1 frames.
+    BufferedClip(StreamedClip *stream, int capacity, int readAhead);
+    ~BufferedClip();
+
+    int frameCount() const { return numFrames; }
+    const ChannelLayout &getLayout() const { return stream->getLayout(); }
+    const float *frame(int f) const;
+    bool randomAccess() const { return false; }
+
+    Stats getStats() const;
+    int getCapacity() const { return capacity; }
+    int getReadAhead() const { return readAhead; }
+
+protected:
+    BufferedClip(const BufferedClip&);            // not copyable
+    BufferedClip &operator=(const BufferedClip&);
+    void produce();
+    bool needsFrame() const;
+    int wrap(int f) const { return ((f % numFrames) + numFrames) % numFrames; }
+    static double wallClock();
+
+    StreamedClip *stream;
+    int numFrames, frameSize, capacity, readAhead;
+    std::vector<float> ring;          // capacity frames
+    std::thread producer;
+    mutable std::mutex lock;          // guards everything below
+    mutable std::condition_variable wake;
+    // The ring holds count frames, first, first+step, ..., starting at
+    // slot head. playhead is the offset of the last requested frame.
+    mutable int first, step, head, count, playhead;
+    mutable int requested;            // last frame asked for
+    mutable int generation;           // bumped whenever the run restarts
+    bool stopping;
+    mutable Stats stats;
+    mutable double lastReport;
+    // Only touched by the render thread.
+    mutable std::vector<float> current;
+    mutable int currentFrame;
+};
+
+// Definitions below
+
+inline BufferedClip::BufferedClip(StreamedClip *stream, int capacity, int readAhead) {
+    this->stream = stream;
+    numFrames = stream->frameCount();
+    frameSize = stream->getLayout().frameSize;
+    this->capacity = std::max(capacity, 2);
+    this->readAhead = std::max(1, std::min(readAhead, this->capacity - 1));
+    ring.resize((size_t)this->capacity*frameSize);
+    std::memset(&stats, 0, sizeof(stats));
+    lastReport = 0;
+    // Frame 0 is decoded here so there is always something to show.
+    const float *values = stream->frame(0);
+    current.assign(values, values + frameSize);
+    currentFrame = 0;
+    first = 0;
+    step = 1;
+    head = 0;
+    count = 0;
+    playhead = 0;
+    requested = 0;
+    generation = 0;
+    stopping = false;
+    producer = std::thread(&BufferedClip::produce, this);
+}
+
+inline BufferedClip::~BufferedClip() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    producer.join();
+    delete stream;
+}
+
+inline double BufferedClip::wallClock() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline BufferedClip::Stats BufferedClip::getStats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+inline bool BufferedClip::needsFrame() const {
+    return count < numFrames && count - 1 - playhead < readAhead;
+}
+
+inline const float *BufferedClip::frame(int f) const {
+    if (f == currentFrame) {
+        return current.data();
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    stats.requests++;
+    int offset = wrap(step*(f - first));
+    if (offset < count) {
+        requested = f;
+        playhead = offset;
+        const float *values = &ring[(size_t)((head + offset) % capacity)*frameSize];
+        current.assign(values, values + frameSize);
+        currentFrame = f;
+        guard.unlock();
+        wake.notify_one();
+        return current.data();
+    }
+    // Underrun: keep showing the previous frame and restart the run at
+    // f, heading the way playback appears to be going.
+    stats.underruns++;
+    step = (wrap(requested - f) < wrap(f - requested)) ? -1 : 1;
+    requested = f;
+    first = f;
+    head = 0;
+    count = 0;
+    playhead = 0;
+    generation++;
+    double now = wallClock();
+    if (now - lastReport > 5) {
+        std::cerr << "Buffered clip: " << stats.underruns << " underruns in "
+                  << stats.requests << " requests (ring " << capacity
+                  << ", read-ahead " << readAhead << ")" << std::endl;
+        lastReport = now;
+    }
+    guard.unlock();
+    wake.notify_one();
+    return current.data();
+}
+
+inline void BufferedClip::produce() {
+    std::vector<float> values(frameSize);
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        wake.wait(guard, [this] { return stopping || needsFrame(); });
+        if (stopping) {
+            break;
+        }
+        int run = generation;
+        int f = wrap(first + step*count);
+        // Decode without holding the lock so the render thread can
+        // keep taking frames meanwhile.
+        guard.unlock();
+        const float *decoded = stream->frame(f);
+        std::copy(decoded, decoded + frameSize, values.begin());
+        guard.lock();
+        if (run != generation) {
+            continue; // the run restarted while we were reading
+        }
+        if (count == capacity) {
+            // Full: drop the oldest frame, which is behind the playhead
+            // because readAhead < capacity.
+            first = wrap(first + step);
+            head = (head + 1) % capacity;
+            count--;
+            playhead--;
+        }
+        std::copy(values.begin(), values.end(),
+                  ring.begin() + (size_t)((head + count) % capacity)*frameSize);
+        count++;
+        stats.framesDecoded++;
+    }
+}
+
+#endif
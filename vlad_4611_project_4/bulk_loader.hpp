@@ -0,0 +1,451 @@
+#ifndef BULK_LOADER_HPP
+#define BULK_LOADER_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define BULK_LOADER_IO_URING 1
+#endif
+
+// Reads many whole files (a mocap library, say) as fast as the disk
+// allows and hands each one to a handler on a pool of worker threads
+// as soon as it has arrived, so reading and parsing overlap.
+//
+// On Linux, reads for up to queueDepth files are kept in flight at
+// once through io_uring. Elsewhere, or if the kernel refuses to set up
+// a ring or to read through it, files are read one after the other
+// with pread (or read) on the calling thread, which still overlaps
+// with the workers. If the ring stops working halfway, the files it
+// had not finished are read that way too.
+//
+// Files held in memory at a time: up to queueDepth being read (one with
+// the fallback), up to queueDepth more waiting for a worker, and the
+// one each worker is handling.
+class BulkLoader {
+public:
+    struct Stats {
+        int files;          // read successfully
+        int failed;         // could not be opened or read
+        uint64_t bytes;
+        double seconds;     // from the first open to the last handler
+        bool usedIoUring;
+        double megabytesPerSecond() const { return seconds > 0 ? bytes/1e6/seconds : 0; }
+        double filesPerSecond() const { return seconds > 0 ? files/seconds : 0; }
+    };
+
+    // Called once per file that was read, on a worker thread, with the
+    // file's index in the list and its contents. The data is only valid
+    // during the call.
+    typedef std::function<void(int index, const char *data, size_t size)> Handler;
+
+    BulkLoader();
+    // threads = 0 uses one worker per core.
+    void setThreads(int threads) { this->threads = threads; }
+    void setQueueDepth(int depth) { queueDepth = std::max(1, depth); }
+    // Turns io_uring off, e.g. to compare against the fallback.
+    void setUseIoUring(bool use) { useIoUring = use; }
+
+    Stats load(const std::vector<std::string> &filenames, Handler handler);
+
+protected:
+    struct Buffer {
+        int index;
+        std::vector<char> data;
+    };
+    // Returns a buffer of the given size, reusing one a worker is done
+    // with if possible so that big files do not fault in fresh pages.
+    Buffer *allocate(int index, size_t size);
+    // Hands a finished buffer to the workers, waiting while too many
+    // are queued.
+    void deliver(Buffer *buffer);
+    // Gives back a buffer that will not be delivered.
+    void release(Buffer *buffer);
+    // Both read the files i with pending[i] set and clear it once the
+    // file is delivered or has failed. readWithIoUring() returns false
+    // if it could not read them all, leaving the rest pending.
+    bool readWithPread(const std::vector<std::string> &filenames, std::vector<char> &pending);
+    static void closeFile(int fd);
+#ifdef BULK_LOADER_IO_URING
+    bool readWithIoUring(const std::vector<std::string> &filenames, std::vector<char> &pending);
+#endif
+
+    int threads, queueDepth;
+    bool useIoUring;
+    Stats stats;
+    std::mutex lock;
+    std::condition_variable ready, space;
+    std::deque<Buffer*> queue;
+    std::vector<Buffer*> spare;
+    bool finished;
+};
+
+// Definitions below
+
+inline BulkLoader::BulkLoader() {
+    threads = 0;
+    queueDepth = 16;
+    useIoUring = true;
+    finished = false;
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+inline BulkLoader::Buffer *BulkLoader::allocate(int index, size_t size) {
+    Buffer *buffer = NULL;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!spare.empty()) {
+            buffer = spare.back();
+            spare.pop_back();
+        }
+    }
+    if (!buffer) {
+        buffer = new Buffer;
+    }
+    buffer->index = index;
+    buffer->data.resize(size);
+    return buffer;
+}
+
+inline void BulkLoader::deliver(Buffer *buffer) {
+    std::unique_lock<std::mutex> guard(lock);
+    space.wait(guard, [this] { return (int)queue.size() < queueDepth; });
+    stats.files++;
+    stats.bytes += buffer->data.size();
+    queue.push_back(buffer);
+    guard.unlock();
+    ready.notify_one();
+}
+
+inline void BulkLoader::release(Buffer *buffer) {
+    std::lock_guard<std::mutex> guard(lock);
+    spare.push_back(buffer);
+}
+
+inline BulkLoader::Stats BulkLoader::load(const std::vector<std::string> &filenames,
+                                          Handler handler) {
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    std::memset(&stats, 0, sizeof(stats));
+    finished = false;
+    int workerCount = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (int t = 0; t < workerCount; t++) {
+        workers.push_back(std::thread([this, &handler]() {
+            while (true) {
+                std::unique_lock<std::mutex> guard(lock);
+                ready.wait(guard, [this] { return finished || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                Buffer *buffer = queue.front();
+                queue.pop_front();
+                guard.unlock();
+                space.notify_one();
+                handler(buffer->index, buffer->data.data(), buffer->data.size());
+                guard.lock();
+                spare.push_back(buffer);
+            }
+        }));
+    }
+
+    std::vector<char> pending(filenames.size(), 1);
+    bool done = false;
+#ifdef BULK_LOADER_IO_URING
+    if (useIoUring) {
+        done = readWithIoUring(filenames, pending);
+    }
+#endif
+    if (!done) {
+        readWithPread(filenames, pending);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        finished = true;
+    }
+    ready.notify_all();
+    for (int t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    for (int b = 0; b < spare.size(); b++) {
+        delete spare[b];
+    }
+    spare.clear();
+    stats.seconds = duration<double>(steady_clock::now() - start).count();
+    return stats;
+}
+
+inline void BulkLoader::closeFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+inline bool BulkLoader::readWithPread(const std::vector<std::string> &filenames,
+                                      std::vector<char> &pending) {
+    for (int i = 0; i < filenames.size(); i++) {
+        if (!pending[i]) {
+            continue;
+        }
+        pending[i] = 0;
+#ifdef _WIN32
+        int fd = _open(filenames[i].c_str(), _O_RDONLY | _O_BINARY);
+        struct _stat64 st;
+        bool opened = fd >= 0 && _fstat64(fd, &st) == 0;
+#else
+        int fd = ::open(filenames[i].c_str(), O_RDONLY);
+        struct stat st;
+        bool opened = fd >= 0 && fstat(fd, &st) == 0;
+#endif
+        if (!opened) {
+            if (fd >= 0) {
+                closeFile(fd);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            stats.failed++;
+            continue;
+        }
+        Buffer *buffer = allocate(i, (size_t)st.st_size);
+        size_t got = 0;
+        while (got < buffer->data.size()) {
+#ifdef _WIN32
+            int n = _read(fd, &buffer->data[got], (unsigned)std::min<size_t>(buffer->data.size() - got, 1 << 30));
+#else
+            ssize_t n = pread(fd, &buffer->data[got], buffer->data.size() - got, (off_t)got);
+#endif
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        closeFile(fd);
+        buffer->data.resize(got); // the file may have shrunk meanwhile
+        deliver(buffer);
+    }
+    return true;
+}
+
+#ifdef BULK_LOADER_IO_URING
+
+// io_uring driven directly through its system calls, so that no extra
+// library is needed. One read per file is kept in flight; a short read
+// (a file larger than one read can return) is resubmitted for the rest.
+// A read that fails counts the file as failed, except when the very
+// first one fails for lack of support (kernels before 5.6 have no
+// IORING_OP_READ): then the files go to readWithPread() instead.
+inline bool BulkLoader::readWithIoUring(const std::vector<std::string> &filenames,
+                                        std::vector<char> &pending) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int ring = (int)syscall(__NR_io_uring_setup, queueDepth, &params);
+    if (ring < 0) {
+        return false;
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+    char *sq = (char*)mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring, IORING_OFF_SQ_RING);
+    char *cq = (char*)mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring, IORING_OFF_CQ_RING);
+    io_uring_sqe *sqes = (io_uring_sqe*)mmap(NULL, params.sq_entries*sizeof(io_uring_sqe),
+                                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                             ring, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sq != MAP_FAILED) {
+            munmap(sq, sqSize);
+        }
+        if (cq != MAP_FAILED) {
+            munmap(cq, cqSize);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, params.sq_entries*sizeof(io_uring_sqe));
+        }
+        ::close(ring);
+        return false;
+    }
+    unsigned *sqTail = (unsigned*)(sq + params.sq_off.tail);
+    unsigned sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    unsigned *sqArray = (unsigned*)(sq + params.sq_off.array);
+    unsigned *cqHead = (unsigned*)(cq + params.cq_off.head);
+    unsigned *cqTail = (unsigned*)(cq + params.cq_off.tail);
+    unsigned cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    io_uring_cqe *cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    stats.usedIoUring = true;
+
+    struct Slot {
+        int fd;
+        size_t got;
+        Buffer *buffer;
+    };
+    // The kernel may round the ring up; only queueDepth reads are
+    // kept in flight regardless.
+    int depth = std::min((int)params.sq_entries, queueDepth);
+    std::vector<Slot> slots(depth);
+    std::vector<int> freeSlots;
+    std::vector<Buffer*> retired;   // not reused, see below
+    for (int s = depth - 1; s >= 0; s--) {
+        freeSlots.push_back(s);
+    }
+    unsigned tail = *sqTail;
+    int toSubmit = 0, inFlight = 0, next = 0;
+    bool anyRead = false, unsupported = false, broken = false;
+    // Queues a read of the rest of slot s's file.
+    auto submit = [&](int s) {
+        Slot &slot = slots[s];
+        io_uring_sqe &sqe = sqes[tail & sqMask];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = slot.fd;
+        sqe.addr = (uint64_t)(uintptr_t)(slot.buffer->data.data() + slot.got);
+        sqe.len = (unsigned)std::min<size_t>(slot.buffer->data.size() - slot.got, 1u << 30);
+        sqe.off = slot.got;
+        sqe.user_data = s;
+        sqArray[tail & sqMask] = tail & sqMask;
+        tail++;
+        toSubmit++;
+        inFlight++;
+    };
+    auto finish = [&](int s) {
+        Slot &slot = slots[s];
+        ::close(slot.fd);
+        slot.buffer->data.resize(slot.got);
+        pending[slot.buffer->index] = 0;
+        deliver(slot.buffer);
+        freeSlots.push_back(s);
+    };
+    // Gives slot s up, counting its file as failed or leaving it for
+    // readWithPread().
+    auto abandon = [&](int s, bool failed) {
+        Slot &slot = slots[s];
+        ::close(slot.fd);
+        if (failed) {
+            pending[slot.buffer->index] = 0;
+            std::lock_guard<std::mutex> guard(lock);
+            stats.failed++;
+        }
+        release(slot.buffer);
+        freeSlots.push_back(s);
+    };
+
+    while ((next < filenames.size() && !unsupported) || inFlight > 0) {
+        while (next < filenames.size() && !unsupported && !freeSlots.empty()) {
+            int i = next++;
+            if (!pending[i]) {
+                continue;
+            }
+            int fd = ::open(filenames[i].c_str(), O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                pending[i] = 0;
+                std::lock_guard<std::mutex> guard(lock);
+                stats.failed++;
+                continue;
+            }
+            int s = freeSlots.back();
+            freeSlots.pop_back();
+            slots[s].fd = fd;
+            slots[s].got = 0;
+            slots[s].buffer = allocate(i, (size_t)st.st_size);
+            if (st.st_size == 0) {
+                finish(s);
+            } else {
+                submit(s);
+            }
+        }
+        if (inFlight == 0) {
+            continue;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        int submitted = (int)syscall(__NR_io_uring_enter, ring, toSubmit, 1,
+                                     IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0 && errno != EINTR) {
+            // Should not happen. The files in flight are left pending
+            // for readWithPread(); their buffers are not reused, as the
+            // kernel may still be reading into them until the ring is
+            // closed.
+            for (int s = 0; s < depth; s++) {
+                if (std::find(freeSlots.begin(), freeSlots.end(), s) == freeSlots.end()) {
+                    ::close(slots[s].fd);
+                    retired.push_back(slots[s].buffer);
+                }
+            }
+            broken = true;
+            break;
+        }
+        if (submitted > 0) {
+            toSubmit -= submitted;
+        }
+        unsigned head = *cqHead;
+        unsigned cqReady = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        std::vector<int> resubmit;
+        for (; head != cqReady; head++) {
+            io_uring_cqe &cqe = cqes[head & cqMask];
+            int s = (int)cqe.user_data;
+            inFlight--;
+            if (cqe.res < 0) {
+                if (!anyRead && (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP)) {
+                    unsupported = true;
+                    stats.usedIoUring = false;
+                }
+                abandon(s, !unsupported);
+                continue;
+            }
+            if (cqe.res > 0) {
+                anyRead = true;
+                slots[s].got += cqe.res;
+                if (slots[s].got < slots[s].buffer->data.size() && !unsupported) {
+                    resubmit.push_back(s);
+                    continue;
+                }
+            }
+            if (unsupported && slots[s].got < slots[s].buffer->data.size()) {
+                abandon(s, false);
+            } else {
+                finish(s); // complete or at end of file
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        for (int r = 0; r < resubmit.size(); r++) {
+            submit(resubmit[r]);
+        }
+    }
+    munmap(sqes, params.sq_entries*sizeof(io_uring_sqe));
+    munmap(cq, cqSize);
+    munmap(sq, sqSize);
+    ::close(ring);
+    for (int b = 0; b < retired.size(); b++) {
+        delete retired[b];
+    }
+    return !unsupported && !broken;
+}
+
+#endif
+
+#endif
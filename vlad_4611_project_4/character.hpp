@@ -2,20 +2,29 @@
 #define CHARACTER_HPP
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <glm/ext.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include "asf_file.hpp"
+#include "buffered_clip.hpp"
+#include "clip.hpp"
+#include "clip_cache.hpp"
+#include "clip_database.hpp"
 #include "draw.hpp"
+#include "frame_source.hpp"
+#include "live_clip.hpp"
+#include "lossy_clip.hpp"
+#include "mapped_reader.hpp"
+#include "pose.hpp"
 #include "reader.hpp"
+#include "skeleton.hpp"
+#include "streamed_clip.hpp"
 using namespace std;
 using glm::vec3;
 using glm::mat4;
 
-// Forward declarations
-class Bone;
-class RotationBounds;
-
 // This is the root class for the animated character. You can also
 // think of this as a root node a scene graph. The class takes care of
 // loading the skeleton file and also animation file(s) needed to draw
@@ -26,17 +35,58 @@ class RotationBounds;
 class Character {
 public:
 
+    // The parsed skeleton and clip are kept in a compiled cache file
+    // next to the AMC file (see clip_cache.hpp). Later runs map that
+    // file instead of parsing the text files again, as long as
+    // neither source file has changed.
+    //
+    // With PLAYBACK_STREAM, the AMC file is instead read from disk one
+    // frame at a time (see StreamedClip), which keeps memory use
+    // independent of the clip length; with a nonzero bufferFrames the
+    // reading happens on a background thread (see BufferedClip).
+    // PLAYBACK_FOLLOW tails a file that is still being written (see
+    // LiveClip); playback then stays liveLatency seconds behind the
+    // newest frame and ignores dt. A preloaded clip can also be
+    // replaced by a LossyClip within lossyTolerance meters.
     Character(std::string asfFilename, std::string amcFilename,
+              vec3 basePosition, vec3 baseVelocity,
+              PlaybackOptions playback = PlaybackOptions());
+
+    // Plays a clip straight out of a packed database, which must stay
+    // open for as long as the character exists.
+    Character(const ClipDatabase &database, int clip,
               vec3 basePosition, vec3 baseVelocity);
 
+    // Another instance of model, e.g. one more walker in a crowd. It
+    // shares model's skeleton and plays model's clip, so nothing is
+    // read or parsed; what it has of its own is its pose and where it
+    // is in the clip. model must outlive it. Only clips that allow
+    // random access (FrameSource::randomAccess(): preloaded, database
+    // and lossy clips) can be shared; an instance of a streamed or
+    // followed character gets the skeleton but no animation.
+    Character(const Character &model, vec3 basePosition, vec3 baseVelocity);
+
+    // Loads only a skeleton, e.g. to pack clips for it.
+    explicit Character(std::string asfFilename);
+    ~Character();
+
     // Advance the mocap data by a time dt. Note that this need not be
     // the same as the animation time in the program, if you want to
     // play back the mocap animation at a different speed from what it
     // was recorded. The frame rate of the mocap data is 120 fps, so
     // if you want to advance exactly one mocap frame you should use
-    // dt = 1/120.f.
+    // dt = 1/120.f. dt may be negative, and large steps cost no more
+    // than small ones; the clip loops in both directions.
     void advance(float dt);
 
+    // Jumps straight to the given mocap frame (wrapped into the clip).
+    void seek(int frame);
+
+    // Switches to another clip of the database this character was
+    // made from. The clip must use the same skeleton; returns false
+    // otherwise.
+    bool switchClip(int clip);
+
     // This returns the current coordinate frame of the ROOT NODE of
     // the character, typically this is the character's pelvis -- all
     // of the root node bones should be drawn relative to this
@@ -47,124 +97,226 @@ public:
     // This returns just the current position of the ROOT NODE.
     vec3 getCurrentPosition();
 
-    // This is an array of pointers to bones. It will contain one or
-    // more bones that are attached to the root node of the character.
-    // Each of these bones will, in turn, have 0 or more child bones.
-    vector<Bone*> rootNodeBones;
-  
-    // DONE: Implement this routine to draw all the character's bones
-    // in the correct pose based on the current animation data.
+    // The bones of the character, in hierarchy order.
+    const Skeleton &getSkeleton() const { return *skeleton; }
+    // The same skeleton, which never changes once loaded and is shared
+    // by every instance of this character.
+    std::shared_ptr<const Skeleton> sharedSkeleton() const { return skeleton; }
+
+    // Where every bone is in the current frame, relative to the space
+    // draw() is called in (getCurrentCoordinateFrame() is the root).
+    // It is computed when the frame changes, not when it is read.
+    const Pose &getPose() const { return pose; }
+
+    // Draws all the character's bones in the pose of the current
+    // frame.
     void draw();
 
-    bool hasAnimation() {return !anim->fail();}
-    bool hasSkeleton() {return !boneTable.empty();}
+    // A followed file counts as animated even before its first frame
+    // has been written.
+    bool hasAnimation() {return live || (source && source->frameCount() > 0);}
+    bool hasSkeleton() {return skeleton && !skeleton->empty();}
+
+    // World positions of the root and of the end of every bone for one
+    // frame of channel values (in the layout of channelLayout()),
+    // without touching the current pose. The base position and
+    // velocity compensation is not applied.
+    void jointPositions(const float *values, std::vector<vec3> &joints);
+
+    // The range of every channel allowed by the ASF limits; root
+    // channels have no limits and get an empty range.
+    void channelBounds(std::vector<float> &minValues, std::vector<float> &maxValues);
+
+    ChannelLayout channelLayout();
+
+    // The skeleton in the records of a .amcb cache. Returns false if a
+    // bone name does not fit.
+    bool skeletonRecords(std::vector<ClipCache::BoneRecord> &records,
+                         std::vector<ClipCache::Link> &links);
+    bool usesDegrees() {return deg;}
+    vec3 getRootPosition() {return rootPosition;}
+    vec3 getRootOrientation() {return rootOrientation;}
 
 protected:
+    Character(const Character&);            // not copyable, see the instance constructor
+    Character &operator=(const Character&);
     void loadAnimation(std::string amcFilename);
     void loadSkeleton(std::string asfFilename);  
-    void resetFile();
-    void nextFrame();
+    bool loadCache(std::string cacheFilename, std::string asfFilename,
+                   std::string amcFilename);
+    void writeCache(std::string cacheFilename, std::string asfFilename,
+                    std::string amcFilename);
+    void buildSkeleton(const ClipCache::BoneRecord *records, int boneCount,
+                       const ClipCache::Link *links, int linkCount);
+    void compressClip(float tolerance);
+    void drawBone(int b, const mat4 &transform);
+    void resetPose();
+    void showFrame(int f);
+    void applyFrame(int f);
     // float deg2rad(float d);
-    void parseUnits(Reader &r);
-    void parseRoot(Reader &r);
-    void parseBonedata(Reader &r);
-    void parseHierarchy(Reader &r);
     bool deg;
     float time;
     vec3 position;
     vec3 orientation;
+    vec3 rootPosition, rootOrientation; // as given by the ASF :root
     int animationFrame;
     vec3 basePosition, baseVelocity; // to compensate for translation in amc
-    std::map<string, Bone*> boneTable;
-    std::ifstream *anim;
-};
-
-// This class just provides a data structure to store information
-// about how each bone can move, including whether it can rotate in
-// the x, y, and z directions (some joints support rotation along all
-// axes, others are just 1-dimensional) and the min and max angles of
-// rotation for each axis.
-class RotationBounds {
-public:
-    RotationBounds();  
-    void setdof(bool rx, bool ry, bool rz);
-    void setR(int index, float min, float max);
-    bool dofRX;
-    bool dofRY;
-    bool dofRZ;
-    int dofs;
-    float minRX;
-    float maxRX;
-    float minRY;
-    float maxRY;
-    float minRZ;
-    float maxRZ;
+    std::shared_ptr<const Skeleton> skeleton;
+    Pose pose;                  // of the current frame
+    AnimationClip clip;
+    const FrameSource *source; // &clip, a database clip, or a clip owned by this
+    LiveClip *live;      // same as source when following a file
+    const ClipDatabase *database; // if playing from one
+    int databaseSkeleton;
+    bool sharedSource;   // source belongs to the character this is an instance of
 };
 
-// This class holds the data for a single articulated joint and bone
-// of an animated character. It also stores a list of 0 or more child
-// bones. So, it can be used to create a scenegraph for an animated
-// character.
-class Bone {
-public:
-
-    // This constructor is setup to read data from the CMU motion
-    // capture database files.
-    Bone(Reader &r, bool deg);
-
-    // Bones are named based on parts of the body
-    std::string getName();    
-  
-    // Returns the rotation of this joint in the body.
-    mat4 getCurrentLocalRotation();
+inline Character::Character(std::string asfFilename, std::string amcFilename,
+                            vec3 basePosition, vec3 baseVelocity,
+                            PlaybackOptions playback) {
+    time = 0;
+    deg = false;
+    source = NULL;
+    live = NULL;
+    database = NULL;
+    databaseSkeleton = -1;
+    sharedSource = false;
+    this->basePosition = basePosition;
+    this->baseVelocity = baseVelocity;
+    if (playback.mode == PLAYBACK_STREAM) {
+        loadSkeleton(asfFilename);
+        StreamedClip *stream = new StreamedClip;
+        if (stream->open(amcFilename, channelLayout())) {
+            if (playback.bufferFrames > 0) {
+                source = new BufferedClip(stream, playback.bufferFrames, playback.readAhead);
+            } else {
+                source = stream;
+            }
+            showFrame(0);
+        } else {
+            delete stream;
+        }
+        return;
+    }
+    if (playback.mode == PLAYBACK_FOLLOW) {
+        loadSkeleton(asfFilename);
+        LiveClip *follow = new LiveClip;
+        if (follow->open(amcFilename, channelLayout())) {
+            follow->setLatencyTarget(playback.liveLatency);
+            source = live = follow;
+            showFrame(live->playbackFrame());
+        } else {
+            delete follow;
+        }
+        return;
+    }
+    std::string cacheFilename = ClipCache::filenameFor(amcFilename);
+    if (!loadCache(cacheFilename, asfFilename, amcFilename)) {
+        loadSkeleton(asfFilename);
+        loadAnimation(amcFilename);
+        if (hasSkeleton() && hasAnimation()) {
+            writeCache(cacheFilename, asfFilename, amcFilename);
+        }
+    }
+    if (playback.lossyTolerance > 0 && hasSkeleton() && hasAnimation()) {
+        compressClip(playback.lossyTolerance);
+    }
+}
 
-    // Returns a vector that is scaled to the length of the bone and
-    // points in the direction of the bone. In the bone's local
-    // coordinate frame, you can think of the bone as beginning at
-    // (0,0,0) and ending at the postion (0,0,0) + getBoneVector().
-    vec3 getBoneVector() { return length * direction; }
+inline Character::Character(const ClipDatabase &database, int clip,
+                            vec3 basePosition, vec3 baseVelocity) {
+    time = 0;
+    source = NULL;
+    live = NULL;
+    sharedSource = false;
+    this->database = &database;
+    this->basePosition = basePosition;
+    this->baseVelocity = baseVelocity;
+    databaseSkeleton = database.getClip(clip).getSkeleton();
+    const ClipDatabaseFile::SkeletonEntry &skeleton = database.getSkeleton(databaseSkeleton);
+    deg = skeleton.degrees != 0;
+    rootPosition = vec3(skeleton.rootPosition[0], skeleton.rootPosition[1],
+                        skeleton.rootPosition[2]);
+    rootOrientation = vec3(skeleton.rootOrientation[0], skeleton.rootOrientation[1],
+                           skeleton.rootOrientation[2]);
+    position = rootPosition;
+    orientation = rootOrientation;
+    buildSkeleton(database.skeletonBones(databaseSkeleton), skeleton.boneCount,
+                  database.skeletonLinks(databaseSkeleton), skeleton.linkCount);
+    source = &database.getClip(clip);
+    showFrame(0);
+}
 
-    // An array of pointers to the other bones that are children of this
-    // one in the scenegraph. All children attach to the end of the
-    // bone.
-    std::vector<Bone*> children;
+inline Character::Character(const Character &model, vec3 basePosition, vec3 baseVelocity) {
+    time = 0;
+    deg = model.deg;
+    rootPosition = model.rootPosition;
+    rootOrientation = model.rootOrientation;
+    position = rootPosition;
+    orientation = rootOrientation;
+    this->basePosition = basePosition;
+    this->baseVelocity = baseVelocity;
+    skeleton = model.skeleton;
+    source = model.source;
+    if (source && !source->randomAccess()) {
+        std::cerr << "Character: instances cannot share a clip that is streamed, "
+                  << "followed or archived" << std::endl;
+        source = NULL;
+    }
+    live = NULL;
+    database = model.database;
+    databaseSkeleton = model.databaseSkeleton;
+    sharedSource = true;
+    resetPose();
+    if (hasAnimation()) {
+        showFrame(0);
+    }
+}
 
-    // This is the key routine that you need to fill in.
-    void draw();
+inline Character::Character(std::string asfFilename) {
+    time = 0;
+    deg = false;
+    source = NULL;
+    live = NULL;
+    database = NULL;
+    databaseSkeleton = -1;
+    sharedSource = false;
+    basePosition = baseVelocity = vec3(0,0,0);
+    loadSkeleton(asfFilename);
+}
 
-    void addChild(Bone* child);
-    void readPose(Reader &r);
-protected:
-    //TaperedCylinder *cylinder;
-    void constructFromFile(Reader &r, bool deg);
-    // float deg2rad(float d);
-    std::string name;
-    float length;
-    vec3 direction;
-    RotationBounds rotationBounds;    
-    vec3 axis;
-    mat4 initialRotation;
-    mat4 currentRotation;
-    int id;
-    bool deg;
-};
+inline Character::~Character() {
+    if (source != &clip && !database && !sharedSource) {
+        delete source;
+    }
+}
 
-inline Character::Character(std::string asfFilename, std::string amcFilename,
-                            vec3 basePosition, vec3 baseVelocity) {
-    anim = NULL;
+inline bool Character::switchClip(int clip) {
+    if (!database || clip < 0 || clip >= database->clipCount()
+        || database->getClip(clip).getSkeleton() != databaseSkeleton) {
+        return false;
+    }
+    source = &database->getClip(clip);
     time = 0;
-    loadSkeleton(asfFilename);
-    loadAnimation(amcFilename);
-    this->basePosition = basePosition;
-    this->baseVelocity = baseVelocity;
+    showFrame(0);
+    return true;
 }
 
 inline void Character::advance(float dt) {
     float fps = 120;
-    int f0 = round(fps*time), f1 = round(fps*(time + dt));
-    for (int f = f0; f < f1; f++)
-        nextFrame();
+    if (live) {
+        live->poll();
+        showFrame(live->playbackFrame());
+        return;
+    }
     time += dt;
+    showFrame((int)round(fps*time));
+}
+
+inline void Character::seek(int frame) {
+    float fps = 120;
+    time = frame/fps;
+    showFrame(frame);
 }
 
 inline mat4 Character::getCurrentCoordinateFrame() {
@@ -182,74 +334,48 @@ inline vec3 Character::getCurrentPosition() {
 
 inline void Character::draw() {
 	
-    // DONE: Apply the current coordinate frame and then draw the root
-    // node bones of the character.
-
-
-	mat4 CurrCoordFrame = this->getCurrentCoordinateFrame();
+    // Draw the bones of the character where the current pose puts
+    // them.
 
-	glPushMatrix(); // Start Base Offset
 
-		glMultMatrixf(&CurrCoordFrame[0][0]); // apply charachter coordinate frame
+	if (live) {
+		live->frameDrawn(animationFrame - 1);
+	}
 
-		for (int i = 0; i < rootNodeBones.size(); i++) { //itterate through all root bones with draw
-			rootNodeBones[i]->draw();
-		}
+	// The pose already includes the character coordinate frame.
+	for (int b = 0; b < pose.boneCount(); b++) {
+		drawBone(b, glm::mat4(pose.world[b]));
+	}
 
-	glPopMatrix(); // End Base Offset
-
-}
-
-inline Bone::Bone(Reader &r, bool deg) {
-    constructFromFile(r, deg);
 }
 
-inline void Bone::draw() {
-
-    // DONE: Draw the bone as a capsule (a cylinder capped by
-    // spheres). Translate to the end of the bone vector and draw the
-    // bone's children, recursively.
+// Draws bone b as a capsule (a cylinder capped by spheres), where
+// transform is the bone's coordinate frame.
+inline void Character::drawBone(int b, const mat4 &transform) {
 
-	vec3  boneVec			= this->getBoneVector();
-	vec3  b					= glm::normalize(boneVec);
-	float bLength			= glm::length(b);  //no problem here
+	vec3  boneVec			= skeleton->boneVector[b];
+	vec3  bVec				= glm::normalize(boneVec);
 	vec3  z					= vec3(0, 0, 1);
-	vec3  rotAxis			= glm::cross(b, z);
-	float rotAxisLength		= glm::length(rotAxis);  
-	float angleRad			= glm::dot(b, z);
+	vec3  rotAxis			= glm::cross(bVec, z);
+	float angleRad			= glm::dot(bVec, z);
 	float angleDeg			= glm::degrees(angleRad);
 
-	mat4 currLocalBoneRot	= this->getCurrentLocalRotation();
-
 	glPushMatrix();
-		glMultMatrixf(&currLocalBoneRot[0][0]);
+		glMultMatrixf(&transform[0][0]);
 		
 
 		Draw::line(boneVec);
 		
-		//string name = this->getName();
-		//if (name == "lhipjoint" || name == "rhipjoint" || name == "lowerback")
-		//{
-		//	Draw::line(rotAxis); //draw axis of rotation for capsule
-		//}
-		
-		Draw::capsule(this->length, boneVec, rotAxis, angleDeg);
-		glTranslatef(boneVec.x, boneVec.y, boneVec.z); // move origin to end of bone before drawing child bone
+		Draw::capsule(skeleton->getInfo(b).length, boneVec, rotAxis, angleDeg);
+		glTranslatef(boneVec.x, boneVec.y, boneVec.z); // move origin to end of bone
 		Draw::axes(.05);
 
-		if (!(this->children.empty()))
-		{
-			for (int i = 0; i < this->children.size(); i++) { // recurse through children
-					this->children[i]->draw();
-			}
-		}
-
 	glPopMatrix();
 
 }
 
-// The rest of the Character, Bone, RotationBounds implementation is
-// in character_impl.hpp. You should not need to modify it.
+// The rest of the Character implementation is in character_impl.hpp.
+// You should not need to modify it.
 
 #include "character_impl.hpp"
 
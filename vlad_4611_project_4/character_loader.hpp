@@ -0,0 +1,117 @@
+#ifndef CHARACTER_LOADER_HPP
+#define CHARACTER_LOADER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "character.hpp"
+#include "clip_catalog.hpp"
+#include "clip_database.hpp"
+#include "clip_packer.hpp"
+#include "config.hpp"
+
+// Builds the Character that Config asks for on a thread of its own,
+// so that reading the skeleton and clip overlaps with creating the
+// window and GL context. Loading only reads files; nothing here
+// touches OpenGL or SDL, so errors are kept for the main thread to
+// report.
+class CharacterLoader {
+public:
+    CharacterLoader();
+    ~CharacterLoader();
+    // Starts loading in the background.
+    void start();
+    // Whether loading is over, successfully or not. Never blocks.
+    bool finished() const { return done; }
+    // The character once finished(), or NULL if it could not be
+    // loaded. The loader owns it.
+    Character *getCharacter() const { return done ? character : NULL; }
+    // Why loading failed, once finished().
+    std::string getError() const { return done ? error : ""; }
+    double loadSeconds() const { return seconds; }
+
+protected:
+    CharacterLoader(const CharacterLoader&);            // not copyable
+    CharacterLoader &operator=(const CharacterLoader&);
+    void load();
+    std::thread worker;
+    std::atomic<bool> done;
+    ClipDatabase database;  // the clip of a database character lives here
+    Character *character;
+    std::string error;
+    double seconds;
+};
+
+// Definitions below
+
+inline CharacterLoader::CharacterLoader() : done(false) {
+    character = NULL;
+    seconds = 0;
+}
+
+inline CharacterLoader::~CharacterLoader() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+    delete character;
+}
+
+inline void CharacterLoader::start() {
+    worker = std::thread(&CharacterLoader::load, this);
+}
+
+inline void CharacterLoader::load() {
+    using namespace std::chrono;
+    steady_clock::time_point begin = steady_clock::now();
+    PlaybackOptions playback(Config::playbackMode);
+    playback.liveLatency = Config::liveLatency;
+    playback.bufferFrames = Config::streamBufferFrames;
+    playback.readAhead = Config::streamReadAhead;
+    playback.lossyTolerance = Config::lossyTolerance;
+    std::string asfFile = Config::asfFile, amcFile = Config::amcFile;
+    vec3 basePosition = Config::basePosition, baseVelocity = Config::baseVelocity;
+    Character *loaded = NULL;
+    if (!Config::databaseFile.empty()) {
+        FileStatus status;
+        if (!getFileStatus(Config::databaseFile, status)) {
+            ClipCatalog catalog;
+            catalog.open(Config::dataDir);
+            ClipPacker::pack(Config::databaseFile, catalog);
+        }
+        int clip = database.open(Config::databaseFile) ? database.findClip(Config::clipName) : -1;
+        if (clip < 0) {
+            error = "No clip named " + Config::clipName + " in " + Config::databaseFile;
+        } else {
+            loaded = new Character(database, clip, vec3(0,0,0), vec3(0,0,0));
+        }
+    } else if (!Config::clipName.empty()) {
+        ClipCatalog catalog;
+        catalog.open(Config::dataDir);
+        const ClipInfo *clip = catalog.find(Config::clipName);
+        if (!clip || clip->skeleton.empty()) {
+            error = "No clip with a skeleton named " + Config::clipName;
+        } else {
+            asfFile = catalog.fullPath(clip->skeleton);
+            amcFile = catalog.fullPath(clip->path);
+            basePosition = baseVelocity = vec3(0,0,0);
+        }
+    }
+    if (!loaded && error.empty()) {
+        loaded = new Character(asfFile, amcFile, basePosition, baseVelocity, playback);
+    }
+    if (loaded && !loaded->hasSkeleton()) {
+        error = "Failed to load file " + asfFile;
+    } else if (loaded && !loaded->hasAnimation()) {
+        error = "Failed to load file " + amcFile;
+    }
+    if (!error.empty()) {
+        delete loaded;
+        loaded = NULL;
+    }
+    character = loaded;
+    seconds = duration<double>(steady_clock::now() - begin).count();
+    done = true;
+}
+
+#endif
@@ -0,0 +1,337 @@
+#ifndef CLIP_HPP
+#define CLIP_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "frame_source.hpp"
+#include "mapped_reader.hpp"
+
+// Describes how the values of one mocap frame are laid out in a flat
+// float array. The first six channels always belong to the root (TX
+// TY TZ RX RY RZ, in AMC units and degrees); every bone added to the
+// layout then gets a contiguous run of channels, one per degree of
+// freedom, in the order rx, ry, rz.
+class ChannelLayout {
+public:
+    ChannelLayout();
+    void addBone(std::string name, int dofs);
+    // Returns the index of the named bone, or -1 if it is not part
+    // of the layout.
+    int boneIndex(const std::string &name) const;
+    int boneCount() const { return (int)offset.size(); }
+    static const int rootChannels = 6;
+    int frameSize;            // number of floats per frame
+    std::vector<int> offset;  // first channel of each bone
+    std::vector<int> dofs;    // number of channels of each bone
+protected:
+    std::map<std::string, int> index;
+};
+
+// The order in which an AMC file lists its channels. AMC files name
+// the same bones in the same order on every frame, so the order is
+// learned from the first frame and every later frame is decoded by
+// position, with only a cheap name comparison per line to catch files
+// whose order changes.
+class ChannelSchema {
+public:
+    struct Entry {
+        std::string name;
+        int bone;    // index in the ChannelLayout, -1 for the root
+        int dofs;    // number of values on the line
+        int offset;  // first channel of those values in a frame
+    };
+    bool empty() const { return entries.empty(); }
+    // Adds the named bone as the next line of a frame. Aborts with an
+    // error if the bone is not in the layout or was already listed.
+    void learn(const std::string &name, const ChannelLayout &layout, int frameNumber);
+    std::vector<Entry> entries;
+};
+
+// A complete AMC motion, parsed once at load time. Frames are stored
+// back to back in a single array so that playback only needs to look
+// up a frame by its index; no parsing or file I/O happens after
+// load() returns.
+class AnimationClip : public FrameSource {
+public:
+    AnimationClip();
+
+    // Parses every frame of the AMC file. The layout decides where
+    // each bone's values go and must come from the skeleton the clip
+    // will be played on. Returns false if the file could not be
+    // opened or contains no frames.
+    //
+    // Large files are cut into chunks at frame boundaries and parsed
+    // on up to `threads` worker threads (0 means one per core); the
+    // result is identical to a sequential parse.
+    bool load(std::string amcFilename, const ChannelLayout &layout, int threads = 0);
+
+    // Same as load(), for the contents of an AMC file that are already
+    // in memory (e.g. read by a BulkLoader).
+    bool parse(const char *begin, const char *end, const ChannelLayout &layout,
+               int threads = 0);
+
+    // Files smaller than this many bytes per extra thread are parsed
+    // sequentially, since starting threads would cost more than it
+    // saves.
+    static const size_t minChunkBytes = 256*1024;
+
+    // Makes the clip use frames that are already decoded somewhere
+    // else, such as the channel block of a mapped cache file, without
+    // copying them. storage is kept alive as long as the clip is.
+    void setFrames(const ChannelLayout &layout, const float *frames, int count,
+                   std::shared_ptr<MappedFile> storage);
+
+    int frameCount() const { return numFrames; }
+    const ChannelLayout &getLayout() const { return layout; }
+    const ChannelSchema &getSchema() const { return schema; }
+
+    // Returns a pointer to the layout.frameSize channel values of
+    // the given frame (0-based).
+    const float *frame(int f) const { return frames() + f*layout.frameSize; }
+
+    // All frames, back to back.
+    const float *frames() const { return external ? external : data.data(); }
+
+    // Parses up to maxFrames frames (all if negative) until the
+    // reader runs out of input, appending them to data. Returns the
+    // number of frames read. If the schema is empty it is learned from
+    // the first frame.
+    template <typename R>
+    static int parseFrames(R &r, const ChannelLayout &layout, ChannelSchema &schema,
+                           std::vector<float> &data, int maxFrames = -1);
+
+protected:
+    void parseChunks(const char *begin, const char *end, int threads);
+    ChannelLayout layout;
+    ChannelSchema schema;
+    int numFrames;
+    std::vector<float> data;
+    const float *external;
+    std::shared_ptr<MappedFile> storage;
+};
+
+// Definitions below
+
+inline ChannelLayout::ChannelLayout() {
+    frameSize = rootChannels;
+}
+
+inline void ChannelLayout::addBone(std::string name, int dofs) {
+    index[name] = (int)offset.size();
+    offset.push_back(frameSize);
+    this->dofs.push_back(dofs);
+    frameSize += dofs;
+}
+
+inline int ChannelLayout::boneIndex(const std::string &name) const {
+    std::map<std::string, int>::const_iterator it = index.find(name);
+    if (it == index.end()) {
+        return -1;
+    }
+    return it->second;
+}
+
+inline void ChannelSchema::learn(const std::string &name, const ChannelLayout &layout,
+                                 int frameNumber) {
+    Entry entry;
+    entry.name = name;
+    if (name == "root") {
+        entry.bone = -1;
+        entry.dofs = ChannelLayout::rootChannels;
+        entry.offset = 0;
+    } else {
+        entry.bone = layout.boneIndex(name);
+        if (entry.bone < 0) {
+            std::cerr << "Unknown bone '" << name << "' in frame "
+                      << frameNumber << std::endl;
+            std::abort();
+        }
+        entry.dofs = layout.dofs[entry.bone];
+        entry.offset = layout.offset[entry.bone];
+    }
+    for (int e = 0; e < entries.size(); e++) {
+        if (entries[e].name == name) {
+            std::cerr << "Bone '" << name << "' listed twice in frame "
+                      << frameNumber << std::endl;
+            std::abort();
+        }
+    }
+    entries.push_back(entry);
+}
+
+inline AnimationClip::AnimationClip() {
+    numFrames = 0;
+    external = NULL;
+}
+
+inline bool AnimationClip::load(std::string amcFilename, const ChannelLayout &layout,
+                                int threads) {
+    MappedFile file;
+    file.open(amcFilename); // a file that cannot be read parses as empty
+    return parse(file.data(), file.data() + file.size(), layout, threads);
+}
+
+inline bool AnimationClip::parse(const char *begin, const char *end,
+                                 const ChannelLayout &layout, int threads) {
+    this->layout = layout;
+    schema = ChannelSchema();
+    numFrames = 0;
+    data.clear();
+    external = NULL;
+    storage.reset();
+    MappedReader r(begin, end);
+    // Skip the header (comments and keywords such as :DEGREES).
+    while (r.good() && !r.upcomingInt()) {
+        r.swallowLine();
+    }
+    // The first frame is read on its own to learn the schema that the
+    // rest of the file, possibly split into chunks, is decoded with.
+    numFrames = parseFrames(r, layout, schema, data, 1);
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t bodySize = end - r.position();
+    if (threads > 1 && bodySize >= 2*minChunkBytes) {
+        parseChunks(r.position(), end, threads);
+    } else {
+        numFrames += parseFrames(r, layout, schema, data);
+    }
+    return numFrames > 0;
+}
+
+inline void AnimationClip::parseChunks(const char *begin, const char *end, int threads) {
+    // Cut the body into roughly equal pieces, moving each cut forward
+    // to the start of the next frame-number line. A few more chunks
+    // than threads keeps all cores busy when chunks parse unevenly.
+    size_t bodySize = end - begin;
+    int numChunks = (int)std::min<size_t>(threads*4, bodySize/minChunkBytes);
+    std::vector<const char*> cuts;
+    cuts.push_back(begin);
+    for (int c = 1; c < numChunks; c++) {
+        const char *p = std::max(begin + bodySize*c/numChunks, cuts.back());
+        while (p < end) {
+            const char *nl = (const char*)std::memchr(p, '\n', end - p);
+            if (!nl) {
+                p = end;
+                break;
+            }
+            p = nl + 1;
+            if (p < end && *p >= '0' && *p <= '9') {
+                break;
+            }
+        }
+        if (p > cuts.back() && p < end) {
+            cuts.push_back(p);
+        }
+    }
+    cuts.push_back(end);
+    numChunks = (int)cuts.size() - 1;
+
+    std::vector<std::vector<float> > chunkData(numChunks);
+    std::vector<int> chunkFrames(numChunks, 0);
+    std::atomic<int> nextChunk(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < std::min(threads, numChunks); t++) {
+        workers.push_back(std::thread([&]() {
+            for (int c = nextChunk++; c < numChunks; c = nextChunk++) {
+                MappedReader r(cuts[c], cuts[c+1]);
+                ChannelSchema chunkSchema = schema;
+                chunkFrames[c] = parseFrames(r, layout, chunkSchema, chunkData[c]);
+            }
+        }));
+    }
+    for (int t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    // Stitch the chunks together in file order, after the frame that
+    // was parsed up front.
+    size_t firstChunk = data.size();
+    for (int c = 0; c < numChunks; c++) {
+        numFrames += chunkFrames[c];
+    }
+    data.resize((size_t)numFrames*layout.frameSize);
+    float *out = data.data() + firstChunk;
+    for (int c = 0; c < numChunks; c++) {
+        std::copy(chunkData[c].begin(), chunkData[c].end(), out);
+        out += chunkData[c].size();
+        std::vector<float>().swap(chunkData[c]);
+    }
+}
+
+inline void AnimationClip::setFrames(const ChannelLayout &layout, const float *frames,
+                                     int count, std::shared_ptr<MappedFile> storage) {
+    this->layout = layout;
+    data.clear();
+    external = frames;
+    numFrames = count;
+    this->storage = storage;
+}
+
+template <typename R>
+inline int AnimationClip::parseFrames(R &r, const ChannelLayout &layout, ChannelSchema &schema,
+                                      std::vector<float> &data, int maxFrames) {
+    int numFrames = 0;
+    std::string bone;
+    while (r.good() && numFrames != maxFrames) {
+        int frameNumber;
+        r.readInt(frameNumber);
+        if (!r.good()) {
+            break;
+        }
+        data.resize(data.size() + layout.frameSize, 0.f);
+        float *values = &data[data.size() - layout.frameSize];
+        numFrames++;
+        if (schema.empty()) {
+            while (r.good() && !r.upcomingInt()) {
+                r.readToken(bone);
+                if (!r.good()) {
+                    break;
+                }
+                schema.learn(bone, layout, frameNumber);
+                const ChannelSchema::Entry &entry = schema.entries.back();
+                for (int d = 0; d < entry.dofs; d++) {
+                    r.readFloat(values[entry.offset + d]);
+                }
+            }
+            continue;
+        }
+        for (int e = 0; e < schema.entries.size(); e++) {
+            const ChannelSchema::Entry &entry = schema.entries[e];
+            r.readToken(bone);
+            if (!r.good()) {
+                // The file ends in the middle of this frame.
+                std::cerr << "Dropping incomplete frame " << frameNumber << std::endl;
+                data.resize(data.size() - layout.frameSize);
+                return numFrames - 1;
+            }
+            if (bone != entry.name) {
+                std::cerr << "Frame " << frameNumber << " lists '" << bone
+                          << "' where '" << entry.name << "' was expected; "
+                          << "bones must appear in the same order in every frame"
+                          << std::endl;
+                std::abort();
+            }
+            float *dofValues = values + entry.offset;
+            for (int d = 0; d < entry.dofs; d++) {
+                r.readFloat(dofValues[d]);
+            }
+        }
+        if (!r.upcomingInt() && r.good()) {
+            std::cerr << "Frame " << frameNumber << " has more bones than the first frame"
+                      << std::endl;
+            std::abort();
+        }
+    }
+    return numFrames;
+}
+
+#endif
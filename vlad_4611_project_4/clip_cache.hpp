@@ -0,0 +1,141 @@
+#ifndef CLIP_CACHE_HPP
+#define CLIP_CACHE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "mapped_file.hpp"
+
+// A compiled ASF/AMC pair (.amcb file) that can be used straight out
+// of a memory mapping. The file is laid out as
+//
+//     Header
+//     BoneRecord[boneCount]   skeleton, in ASF bonedata order
+//     Link[linkCount]         hierarchy, in the order it was built
+//     (padding)
+//     float[frameCount*frameSize] at channelOffset
+//
+// where the channel block holds the frames exactly as AnimationClip
+// stores them. Everything is in native byte order; a cache is only
+// meant to be read on the machine that wrote it.
+namespace ClipCache {
+
+    const uint32_t version = 1;
+    const uint32_t channelAlignment = 64;
+
+    struct Header {
+        char magic[4];             // "AMCB"
+        uint32_t version;
+        uint32_t degrees;          // ASF angles are in degrees
+        uint32_t boneCount;
+        uint32_t linkCount;
+        uint32_t frameSize;        // floats per frame
+        uint32_t frameCount;
+        uint32_t reserved;
+        float rootPosition[3];     // ASF :root, already in meters
+        float rootOrientation[3];
+        uint64_t channelOffset;
+        // Status of the source files when the cache was written.
+        uint64_t asfSize, amcSize;
+        int64_t asfModified, amcModified;
+    };
+
+    struct BoneRecord {
+        char name[32];
+        int32_t id;
+        float direction[3];
+        float length;              // in meters
+        float axis[3];             // degrees, XYZ order
+        uint32_t dofMask;          // bit 0: rx, bit 1: ry, bit 2: rz
+        float limits[6];           // min/max of rx, ry, rz
+    };
+
+    // parent is an index into the bone records, or -1 for bones
+    // attached to the root.
+    struct Link {
+        int32_t parent;
+        int32_t child;
+    };
+
+    // Name of the cache that belongs to an AMC file: the same path
+    // with the extension replaced by ".amcb".
+    std::string filenameFor(std::string amcFilename);
+
+    // Returns the header of a mapped cache file if it is well formed
+    // and was built from the given sources in their current state,
+    // otherwise NULL.
+    const Header *validate(const MappedFile &file,
+                           std::string asfFilename, std::string amcFilename);
+
+    // Whether every link names bones among the first boneCount records
+    // (and parent may be -1), so that a Skeleton can be built from them.
+    bool linksValid(const Link *links, uint32_t linkCount, uint32_t boneCount);
+
+    inline const BoneRecord *bones(const MappedFile &file) {
+        return (const BoneRecord*)(file.data() + sizeof(Header));
+    }
+
+    inline const Link *links(const MappedFile &file) {
+        const Header *header = (const Header*)file.data();
+        return (const Link*)(bones(file) + header->boneCount);
+    }
+
+    inline const float *channels(const MappedFile &file) {
+        const Header *header = (const Header*)file.data();
+        return (const float*)(file.data() + header->channelOffset);
+    }
+
+    // Definitions below
+
+    inline std::string filenameFor(std::string amcFilename) {
+        size_t dot = amcFilename.find_last_of('.');
+        size_t slash = amcFilename.find_last_of("/\\");
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            return amcFilename + ".amcb";
+        }
+        return amcFilename.substr(0, dot) + ".amcb";
+    }
+
+    inline const Header *validate(const MappedFile &file,
+                                  std::string asfFilename, std::string amcFilename) {
+        if (!file.isOpen() || file.size() < sizeof(Header)) {
+            return NULL;
+        }
+        const Header *header = (const Header*)file.data();
+        if (std::memcmp(header->magic, "AMCB", 4) != 0 || header->version != version) {
+            return NULL;
+        }
+        uint64_t tables = sizeof(Header) + (uint64_t)header->boneCount*sizeof(BoneRecord)
+            + (uint64_t)header->linkCount*sizeof(Link);
+        uint64_t channelBytes = (uint64_t)header->frameCount*header->frameSize*sizeof(float);
+        if (header->channelOffset < tables || header->channelOffset % channelAlignment != 0
+            || header->channelOffset + channelBytes > file.size()) {
+            return NULL;
+        }
+        if (!linksValid(links(file), header->linkCount, header->boneCount)) {
+            return NULL;
+        }
+        FileStatus asf, amc;
+        if (!getFileStatus(asfFilename, asf) || !getFileStatus(amcFilename, amc)) {
+            return NULL;
+        }
+        if (asf.size != header->asfSize || asf.modified != header->asfModified
+            || amc.size != header->amcSize || amc.modified != header->amcModified) {
+            return NULL; // a source file changed since the cache was written
+        }
+        return header;
+    }
+
+    inline bool linksValid(const Link *links, uint32_t linkCount, uint32_t boneCount) {
+        for (uint32_t l = 0; l < linkCount; l++) {
+            if (links[l].parent < -1 || links[l].parent >= (int64_t)boneCount
+                || links[l].child < 0 || links[l].child >= (int64_t)boneCount) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+}
+
+#endif
@@ -0,0 +1,491 @@
+#ifndef CLIP_CATALOG_HPP
+#define CLIP_CATALOG_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "bulk_loader.hpp"
+#include "mapped_file.hpp"
+#include "mapped_reader.hpp"
+
+#ifdef _WIN32
+// windows.h comes with mapped_file.hpp
+#else
+#include <dirent.h>
+#endif
+
+// What the catalog knows about one AMC file.
+struct ClipInfo {
+    std::string path;       // relative to the library root, '/'-separated
+    std::string name;       // file name without the extension, e.g. "08_01"
+    std::string subject;    // the part before the first '_', e.g. "08"
+    std::string skeleton;   // relative path of <subject>.asf next to the
+                            // clip, or empty if there is none
+    int frameCount;
+    float duration;         // seconds at 120 fps
+    int layout;             // index into ClipCatalog::getLayouts()
+    float rootTravel;       // length of the root's path, in meters
+    FileStatus status;      // when the file was scanned
+    uint64_t fingerprint;   // FNV-1a hash of the contents
+};
+
+// An index of the clips in a directory tree, so that they can be
+// looked up by name instead of by hardcoded paths.
+//
+// Scanning a clip reads the whole file once (all new files are read
+// together through a BulkLoader and scanned on several threads), so
+// the results are saved to an index file in the root directory
+// (catalog.amci). The next open() reads that index and only rescans
+// files whose size or modification time changed; opening an unchanged
+// library costs one directory walk.
+class ClipCatalog {
+public:
+    struct ScanStats {
+        int clips;
+        int scanned;   // files read because they were new or changed
+        int reused;    // taken from the index
+        double seconds;
+        BulkLoader::Stats reading;  // of the scanned files
+    };
+
+    // Name of the index file, relative to the root.
+    static const char *indexName() { return "catalog.amci"; }
+
+    // Catalogs every AMC file below root. threads = 0 uses one thread
+    // per core. Returns false if root cannot be read.
+    bool open(std::string root, int threads = 0);
+
+    const std::vector<ClipInfo> &getClips() const { return clips; }
+    // Bone names and channel counts of the first frame, e.g.
+    // "root:6 lowerback:3 ...". Clips with the same layout share one.
+    const std::vector<std::string> &getLayouts() const { return layouts; }
+    // Looks a clip up by name ("143_35") or relative path. Returns NULL
+    // if there is no such clip.
+    const ClipInfo *find(std::string nameOrPath) const;
+    // Full path of a relative path in the library.
+    std::string fullPath(std::string relativePath) const { return root + "/" + relativePath; }
+    ScanStats getStats() const { return stats; }
+
+    // Reads the whole file and fills in everything but path, name,
+    // subject and skeleton. Returns false if it cannot be read.
+    static bool scan(std::string filename, ClipInfo &info, std::string &layout);
+    // Same as scan(), for contents already in memory; leaves
+    // info.status alone.
+    static void scan(const char *begin, const char *end, ClipInfo &info, std::string &layout);
+
+protected:
+    static void listFiles(std::string root, std::string relative,
+                          std::vector<std::string> &files);
+    bool readIndex(std::string filename, std::map<std::string, ClipInfo> &known);
+    bool writeIndex(std::string filename) const;
+    int addLayout(const std::string &layout);
+
+    std::string root;
+    std::vector<ClipInfo> clips;
+    std::vector<std::string> layouts;
+    ScanStats stats;
+};
+
+// The index file: a header, one Record per clip, one uint32_t string
+// offset per layout, then the NUL-terminated strings the records and
+// layouts refer to. Native byte order, like the other caches.
+namespace CatalogIndex {
+
+    const uint32_t version = 1;
+
+    struct Header {
+        char magic[4];  // "AMCI"
+        uint32_t version;
+        uint32_t clipCount;
+        uint32_t layoutCount;
+        uint64_t stringsSize;
+    };
+
+    struct Record {
+        uint32_t path, name, subject, skeleton;  // string offsets
+        int32_t layout;
+        uint32_t frameCount;
+        float duration;
+        float rootTravel;
+        uint64_t size;
+        int64_t modified;
+        uint64_t fingerprint;
+    };
+
+}
+
+// Definitions below
+
+inline void ClipCatalog::listFiles(std::string root, std::string relative,
+                                   std::vector<std::string> &files) {
+    std::string dir = relative.empty() ? root : root + "/" + relative;
+    std::string prefix = relative.empty() ? "" : relative + "/";
+#ifdef _WIN32
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA((dir + "/*").c_str(), &entry);
+    if (find == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        std::string name = entry.cFileName;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            listFiles(root, prefix + name, files);
+        } else {
+            files.push_back(prefix + name);
+        }
+    } while (FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    while (dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        bool isDir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            isDir = stat((dir + "/" + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (isDir) {
+            listFiles(root, prefix + name, files);
+        } else {
+            files.push_back(prefix + name);
+        }
+    }
+    closedir(d);
+#endif
+}
+
+inline bool ClipCatalog::scan(std::string filename, ClipInfo &info, std::string &layout) {
+    MappedFile file;
+    if (!file.open(filename) || !getFileStatus(filename, info.status)) {
+        return false;
+    }
+    scan(file.data(), file.data() + file.size(), info, layout);
+    return true;
+}
+
+inline void ClipCatalog::scan(const char *begin, const char *end, ClipInfo &info,
+                              std::string &layout) {
+    const char *p = begin;
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *q = p; q < end; q++) {
+        hash = (hash ^ (unsigned char)*q)*1099511628211ull;
+    }
+    info.fingerprint = hash;
+    info.frameCount = 0;
+    info.rootTravel = 0;
+    layout.clear();
+    glm::vec3 previous;
+    while (p < end) {
+        const char *lineEnd = (const char*)std::memchr(p, '\n', end - p);
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+        if (*p >= '0' && *p <= '9') {
+            info.frameCount++;
+        } else if (info.frameCount > 0 && p < lineEnd) {
+            MappedReader r(p, lineEnd);
+            TokenView bone;
+            r.readToken(bone);
+            if (info.frameCount == 1) {
+                int values = 0;
+                MappedReader rest(r.position(), lineEnd);
+                TokenView value;
+                while (rest.readToken(value), !value.empty()) {
+                    values++;
+                }
+                layout += (layout.empty() ? "" : " ") + bone.str() + ":" + std::to_string(values);
+            }
+            if (bone == "root") {
+                glm::vec3 position;
+                r.readFloat(position.x);
+                r.readFloat(position.y);
+                r.readFloat(position.z);
+                position *= 0.056444f; // as amc2meter
+                if (info.frameCount > 1) {
+                    info.rootTravel += glm::length(position - previous);
+                }
+                previous = position;
+            }
+        }
+        p = lineEnd + 1;
+    }
+    info.duration = info.frameCount/120.f;
+}
+
+inline int ClipCatalog::addLayout(const std::string &layout) {
+    for (int i = 0; i < layouts.size(); i++) {
+        if (layouts[i] == layout) {
+            return i;
+        }
+    }
+    layouts.push_back(layout);
+    return (int)layouts.size() - 1;
+}
+
+inline bool ClipCatalog::open(std::string root, int threads) {
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    this->root = root;
+    clips.clear();
+    layouts.clear();
+    std::memset(&stats, 0, sizeof(stats));
+
+    std::vector<std::string> files;
+    listFiles(root, "", files);
+    if (files.empty()) {
+        FileStatus status;
+        if (!getFileStatus(root, status)) {
+            return false;
+        }
+    }
+    std::sort(files.begin(), files.end());
+    std::set<std::string> skeletons;
+    for (int i = 0; i < files.size(); i++) {
+        if (files[i].size() > 4 && files[i].compare(files[i].size() - 4, 4, ".asf") == 0) {
+            skeletons.insert(files[i]);
+        }
+    }
+
+    std::map<std::string, ClipInfo> known;
+    readIndex(fullPath(indexName()), known);
+
+    std::vector<int> toScan;
+    for (int i = 0; i < files.size(); i++) {
+        const std::string &path = files[i];
+        if (path.size() <= 4 || path.compare(path.size() - 4, 4, ".amc") != 0) {
+            continue;
+        }
+        ClipInfo info;
+        std::map<std::string, ClipInfo>::iterator old = known.find(path);
+        FileStatus status;
+        if (old != known.end() && getFileStatus(fullPath(path), status)
+            && status.size == old->second.status.size
+            && status.modified == old->second.status.modified) {
+            info = old->second;
+            stats.reused++;
+        } else {
+            info.layout = -1;
+            toScan.push_back((int)clips.size());
+        }
+        info.path = path;
+        size_t slash = path.find_last_of('/');
+        std::string dir = (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+        info.name = path.substr(dir.size(), path.size() - dir.size() - 4);
+        info.subject = info.name.substr(0, info.name.find('_'));
+        // Looked up every time, so that adding a skeleton later is noticed.
+        std::string asf = dir + info.subject + ".asf";
+        info.skeleton = skeletons.count(asf) ? asf : "";
+        clips.push_back(info);
+    }
+
+    // Read new and changed files in bulk and scan each on a worker as
+    // soon as it arrives.
+    std::vector<std::string> scannedLayouts(toScan.size());
+    std::vector<char> ok(toScan.size(), 0);
+    std::vector<std::string> filenames(toScan.size());
+    for (int i = 0; i < toScan.size(); i++) {
+        filenames[i] = fullPath(clips[toScan[i]].path);
+        // Taken before reading, so a change made meanwhile is noticed
+        // next time.
+        ok[i] = getFileStatus(filenames[i], clips[toScan[i]].status);
+    }
+    if (!toScan.empty()) {
+        BulkLoader loader;
+        loader.setThreads(threads);
+        stats.reading = loader.load(filenames, [&](int i, const char *data, size_t size) {
+            if (ok[i]) {
+                scan(data, data + size, clips[toScan[i]], scannedLayouts[i]);
+                ok[i] = 2;
+            }
+        });
+    }
+    for (int i = 0; i < toScan.size(); i++) {
+        ok[i] = ok[i] == 2;
+    }
+
+    // Layouts from the index keep their numbers; new ones are added.
+    std::vector<std::string> indexLayouts;
+    indexLayouts.swap(layouts);
+    for (int c = 0; c < clips.size(); c++) {
+        if (clips[c].layout >= 0) {
+            clips[c].layout = addLayout(indexLayouts[clips[c].layout]);
+        }
+    }
+    std::vector<ClipInfo> kept;
+    for (int c = 0, i = 0; c < clips.size(); c++) {
+        if (i < toScan.size() && toScan[i] == c) {
+            if (!ok[i]) {
+                std::cerr << "Catalog: cannot read " << clips[c].path << std::endl;
+                i++;
+                continue;
+            }
+            clips[c].layout = addLayout(scannedLayouts[i]);
+            i++;
+        }
+        kept.push_back(clips[c]);
+    }
+    clips.swap(kept);
+    stats.clips = (int)clips.size();
+    stats.scanned = (int)toScan.size();
+
+    if (stats.scanned > 0 || known.size() != clips.size()) {
+        writeIndex(fullPath(indexName()));
+    }
+    stats.seconds = duration<double>(steady_clock::now() - start).count();
+    std::cerr << "Catalog: " << stats.clips << " clips in " << root << ", "
+              << stats.scanned << " scanned, " << stats.reused << " from the index, "
+              << stats.seconds*1000 << " ms" << std::endl;
+    if (stats.scanned > 0) {
+        std::cerr << "Catalog: read " << stats.reading.files << " files, "
+                  << stats.reading.bytes/1e6 << " MB at " << stats.reading.megabytesPerSecond()
+                  << " MB/s, " << stats.reading.filesPerSecond() << " files/s"
+                  << (stats.reading.usedIoUring ? " (io_uring)" : "") << std::endl;
+    }
+    return true;
+}
+
+inline const ClipInfo *ClipCatalog::find(std::string nameOrPath) const {
+    for (int c = 0; c < clips.size(); c++) {
+        if (clips[c].name == nameOrPath || clips[c].path == nameOrPath) {
+            return &clips[c];
+        }
+    }
+    return NULL;
+}
+
+inline bool ClipCatalog::readIndex(std::string filename,
+                                   std::map<std::string, ClipInfo> &known) {
+    using namespace CatalogIndex;
+    MappedFile file;
+    if (!file.open(filename) || file.size() < sizeof(Header)) {
+        return false;
+    }
+    const Header *header = (const Header*)file.data();
+    uint64_t stringsStart = sizeof(Header) + (uint64_t)header->clipCount*sizeof(Record)
+        + (uint64_t)header->layoutCount*sizeof(uint32_t);
+    if (std::memcmp(header->magic, "AMCI", 4) != 0 || header->version != version
+        || stringsStart + header->stringsSize != file.size()
+        || header->stringsSize == 0 || file.data()[file.size() - 1] != 0) {
+        return false;
+    }
+    const Record *records = (const Record*)(file.data() + sizeof(Header));
+    const uint32_t *layoutOffsets = (const uint32_t*)(records + header->clipCount);
+    const char *strings = file.data() + stringsStart;
+    for (uint32_t l = 0; l < header->layoutCount; l++) {
+        if (layoutOffsets[l] >= header->stringsSize) {
+            return false;
+        }
+        layouts.push_back(strings + layoutOffsets[l]);
+    }
+    for (uint32_t c = 0; c < header->clipCount; c++) {
+        const Record &record = records[c];
+        if (std::max(std::max(record.path, record.name), std::max(record.subject, record.skeleton))
+                >= header->stringsSize
+            || record.layout < 0 || record.layout >= (int32_t)header->layoutCount) {
+            known.clear();
+            layouts.clear();
+            return false;
+        }
+        ClipInfo info;
+        info.path = strings + record.path;
+        info.name = strings + record.name;
+        info.subject = strings + record.subject;
+        info.skeleton = strings + record.skeleton;
+        info.layout = record.layout;
+        info.frameCount = record.frameCount;
+        info.duration = record.duration;
+        info.rootTravel = record.rootTravel;
+        info.status.size = record.size;
+        info.status.modified = record.modified;
+        info.fingerprint = record.fingerprint;
+        known[info.path] = info;
+    }
+    return true;
+}
+
+inline bool ClipCatalog::writeIndex(std::string filename) const {
+    using namespace CatalogIndex;
+    std::string strings;
+    std::map<std::string, uint32_t> offsets;
+    struct Strings {
+        std::string &all;
+        std::map<std::string, uint32_t> &offsets;
+        uint32_t operator()(const std::string &s) {
+            std::map<std::string, uint32_t>::iterator found = offsets.find(s);
+            if (found != offsets.end()) {
+                return found->second;
+            }
+            uint32_t offset = (uint32_t)all.size();
+            all += s;
+            all += '\0';
+            offsets[s] = offset;
+            return offset;
+        }
+    } add = {strings, offsets};
+
+    std::vector<Record> records(clips.size());
+    for (int c = 0; c < clips.size(); c++) {
+        const ClipInfo &info = clips[c];
+        Record &record = records[c];
+        std::memset(&record, 0, sizeof(record));
+        record.path = add(info.path);
+        record.name = add(info.name);
+        record.subject = add(info.subject);
+        record.skeleton = add(info.skeleton);
+        record.layout = info.layout;
+        record.frameCount = info.frameCount;
+        record.duration = info.duration;
+        record.rootTravel = info.rootTravel;
+        record.size = info.status.size;
+        record.modified = info.status.modified;
+        record.fingerprint = info.fingerprint;
+    }
+    std::vector<uint32_t> layoutOffsets;
+    for (int l = 0; l < layouts.size(); l++) {
+        layoutOffsets.push_back(add(layouts[l]));
+    }
+    add(""); // the strings always end with a NUL
+
+    Header header;
+    std::memcpy(header.magic, "AMCI", 4);
+    header.version = version;
+    header.clipCount = (uint32_t)records.size();
+    header.layoutCount = (uint32_t)layoutOffsets.size();
+    header.stringsSize = strings.size();
+
+    // Written to a temporary file first so a crash never leaves a
+    // half-written index behind.
+    std::string tempFilename = filename + ".tmp";
+    std::ofstream out(tempFilename.c_str(), std::ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)records.data(), records.size()*sizeof(Record));
+    out.write((const char*)layoutOffsets.data(), layoutOffsets.size()*sizeof(uint32_t));
+    out.write(strings.data(), strings.size());
+    out.close();
+    if (!out) {
+        std::remove(tempFilename.c_str());
+        return false;
+    }
+    std::remove(filename.c_str());
+    std::rename(tempFilename.c_str(), filename.c_str());
+    return true;
+}
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef CLIP_CODEC_HPP
+#define CLIP_CODEC_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "clip.hpp"
+#include "frame_source.hpp"
+#include "mapped_file.hpp"
+
+// Lossless compression of decoded clip data for archiving (.amcz
+// files). Mocap channels change smoothly at 120 fps, so each value is
+// predicted from the ones before it and only the (small) prediction
+// error is stored, bit-packed.
+//
+// Values are predicted as integers: each float's bits are mapped to a
+// key that orders the same way as the floats, so the round trip is
+// exact for every value, including -0 and denormals. Each channel of
+// each block uses whichever predictor costs fewest bits:
+//
+//     constant  every value equals the first (unused dofs)
+//     previous  key[t-1]
+//     linear    2*key[t-1] - key[t-2]
+//
+// Residuals are zigzag-encoded and packed in groups of groupSize, each
+// group with the bit width of its largest residual.
+//
+// Frames are coded in blocks of blockFrames that do not depend on one
+// another, so any frame can be reached by decoding a single block. The
+// file is laid out as
+//
+//     Header
+//     uint64_t offsets[blockCount+1]   start of each block, and the end
+//     block data
+//
+// in native byte order, like the .amcb cache.
+namespace ClipCodec {
+
+    const uint32_t version = 1;
+    const int defaultBlockFrames = 256;
+    const int groupSize = 16;
+
+    struct Header {
+        char magic[4];          // "AMCZ"
+        uint32_t version;
+        uint32_t frameSize;     // floats per frame
+        uint32_t frameCount;
+        uint32_t blockFrames;   // frames per block (the last may be short)
+        uint32_t blockCount;
+    };
+
+    enum Predictor { PREDICT_CONSTANT, PREDICT_PREVIOUS, PREDICT_LINEAR };
+
+    // Appends the encoded clip to out.
+    void encode(const float *frames, int frameCount, int frameSize,
+                std::vector<char> &out, int blockFrames = defaultBlockFrames);
+
+    // Returns the header if data holds a well-formed archive, else NULL.
+    const Header *validate(const char *data, size_t size);
+
+    inline const uint64_t *blockOffsets(const char *data) {
+        return (const uint64_t*)(data + sizeof(Header));
+    }
+
+    // Number of frames in the given block.
+    int blockLength(const Header &header, int block);
+
+    // Decodes one block into out, which must have room for
+    // blockLength(block)*frameSize floats.
+    void decodeBlock(const char *data, int block, float *out);
+
+    // Decodes the whole clip (frameCount*frameSize floats).
+    void decode(const char *data, float *out);
+
+    // Encodes a clip into an archive file. Returns false if the file
+    // could not be written.
+    bool write(std::string filename, const FrameSource &clip,
+               int blockFrames = defaultBlockFrames);
+
+}
+
+// Plays an archive, decoding one block at a time as frames are asked
+// for. Only the current block is held decoded.
+class ArchivedClip : public FrameSource {
+public:
+    ArchivedClip();
+    // Maps the archive. Returns false if it cannot be read or was
+    // written for a different channel layout.
+    bool open(std::string filename, const ChannelLayout &layout);
+    int frameCount() const { return header ? (int)header->frameCount : 0; }
+    const ChannelLayout &getLayout() const { return layout; }
+    const float *frame(int f) const;
+    bool randomAccess() const { return false; }
+protected:
+    MappedFile file;
+    const ClipCodec::Header *header;
+    ChannelLayout layout;
+    mutable std::vector<float> values;
+    mutable int currentBlock; // block held in values, -1 if none
+};
+
+// Definitions below
+
+namespace ClipCodec {
+
+    // Writes values least significant bit first.
+    class BitWriter {
+    public:
+        BitWriter(std::vector<char> &out) : out(out), acc(0), bits(0) {}
+        void put(uint64_t value, int n) {
+            if (n > 32) {
+                put(value & 0xffffffffu, 32);
+                put(value >> 32, n - 32);
+                return;
+            }
+            acc |= (value & (((uint64_t)1 << n) - 1)) << bits;
+            bits += n;
+            while (bits >= 8) {
+                out.push_back((char)(acc & 0xff));
+                acc >>= 8;
+                bits -= 8;
+            }
+        }
+        // Pads to a whole byte.
+        void flush() {
+            if (bits > 0) {
+                out.push_back((char)(acc & 0xff));
+            }
+            acc = 0;
+            bits = 0;
+        }
+    protected:
+        std::vector<char> &out;
+        uint64_t acc;
+        int bits;
+    };
+
+    // Reads what BitWriter wrote. Reading past the end yields zeros.
+    class BitReader {
+    public:
+        BitReader(const char *begin, const char *end) : p(begin), end(end), acc(0), bits(0) {}
+        uint64_t get(int n) {
+            if (n > 32) {
+                uint64_t low = get(32);
+                return low | (get(n - 32) << 32);
+            }
+            while (bits < n) {
+                uint64_t byte = (p < end) ? (unsigned char)*p++ : 0;
+                acc |= byte << bits;
+                bits += 8;
+            }
+            uint64_t value = acc & (((uint64_t)1 << n) - 1);
+            acc >>= n;
+            bits -= n;
+            return value;
+        }
+    protected:
+        const char *p, *end;
+        uint64_t acc;
+        int bits;
+    };
+
+    // Maps float bits to integers that sort like the floats.
+    inline int64_t toKey(float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, 4);
+        return (bits & 0x80000000u) ? (int64_t)(~bits) : (int64_t)(bits | 0x80000000u);
+    }
+
+    inline float fromKey(int64_t key) {
+        uint32_t k = (uint32_t)key;
+        uint32_t bits = (k & 0x80000000u) ? (k & 0x7fffffffu) : ~k;
+        float value;
+        std::memcpy(&value, &bits, 4);
+        return value;
+    }
+
+    inline uint64_t zigzag(int64_t v) {
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+    }
+
+    inline int64_t unzigzag(uint64_t v) {
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+
+    inline int bitWidth(uint64_t v) {
+        int n = 0;
+        while (v) {
+            n++;
+            v >>= 1;
+        }
+        return n;
+    }
+
+    inline int64_t predict(int predictor, const int64_t *keys, int t) {
+        if (predictor == PREDICT_LINEAR && t >= 2) {
+            return 2*keys[t-1] - keys[t-2];
+        }
+        return keys[t-1];
+    }
+
+    // Zigzagged residuals of frames 1..n-1 under a predictor.
+    inline void residuals(int predictor, const int64_t *keys, int n,
+                          std::vector<uint64_t> &out) {
+        out.clear();
+        for (int t = 1; t < n; t++) {
+            out.push_back(zigzag(keys[t] - predict(predictor, keys, t)));
+        }
+    }
+
+    // Bits needed to pack residuals in groups.
+    inline uint64_t packedBits(const std::vector<uint64_t> &r) {
+        uint64_t total = 0;
+        for (size_t g = 0; g < r.size(); g += groupSize) {
+            size_t end = std::min(r.size(), g + groupSize);
+            uint64_t all = 0;
+            for (size_t i = g; i < end; i++) {
+                all |= r[i];
+            }
+            total += 6 + (end - g)*bitWidth(all);
+        }
+        return total;
+    }
+
+    inline void encodeBlock(const float *frames, int n, int frameSize, std::vector<char> &out) {
+        BitWriter w(out);
+        std::vector<int64_t> keys(n);
+        std::vector<uint64_t> previous, linear;
+        for (int c = 0; c < frameSize; c++) {
+            bool constant = true;
+            for (int t = 0; t < n; t++) {
+                keys[t] = toKey(frames[(size_t)t*frameSize + c]);
+                constant = constant && keys[t] == keys[0];
+            }
+            w.put((uint64_t)keys[0], 32);
+            if (constant) {
+                w.put(PREDICT_CONSTANT, 2);
+                continue;
+            }
+            residuals(PREDICT_PREVIOUS, keys.data(), n, previous);
+            residuals(PREDICT_LINEAR, keys.data(), n, linear);
+            bool useLinear = packedBits(linear) < packedBits(previous);
+            const std::vector<uint64_t> &r = useLinear ? linear : previous;
+            w.put(useLinear ? PREDICT_LINEAR : PREDICT_PREVIOUS, 2);
+            for (size_t g = 0; g < r.size(); g += groupSize) {
+                size_t end = std::min(r.size(), g + groupSize);
+                uint64_t all = 0;
+                for (size_t i = g; i < end; i++) {
+                    all |= r[i];
+                }
+                int width = bitWidth(all);
+                w.put(width, 6);
+                for (size_t i = g; i < end; i++) {
+                    w.put(r[i], width);
+                }
+            }
+        }
+        w.flush();
+    }
+
+    inline void encode(const float *frames, int frameCount, int frameSize,
+                       std::vector<char> &out, int blockFrames) {
+        blockFrames = std::max(blockFrames, 1);
+        Header header;
+        std::memcpy(header.magic, "AMCZ", 4);
+        header.version = version;
+        header.frameSize = frameSize;
+        header.frameCount = frameCount;
+        header.blockFrames = blockFrames;
+        header.blockCount = (frameCount + blockFrames - 1) / blockFrames;
+        size_t start = out.size();
+        size_t tableSize = (header.blockCount + 1)*sizeof(uint64_t);
+        out.resize(start + sizeof(Header) + tableSize);
+        std::memcpy(&out[start], &header, sizeof(Header));
+        std::vector<uint64_t> offsets;
+        for (uint32_t b = 0; b < header.blockCount; b++) {
+            offsets.push_back(out.size() - start);
+            int first = b*blockFrames;
+            encodeBlock(frames + (size_t)first*frameSize,
+                        std::min(blockFrames, frameCount - first), frameSize, out);
+        }
+        offsets.push_back(out.size() - start);
+        std::memcpy(&out[start + sizeof(Header)], offsets.data(), tableSize);
+    }
+
+    inline const Header *validate(const char *data, size_t size) {
+        if (size < sizeof(Header)) {
+            return NULL;
+        }
+        const Header *header = (const Header*)data;
+        if (std::memcmp(header->magic, "AMCZ", 4) != 0 || header->version != version
+            || header->blockFrames == 0
+            || header->blockCount != (header->frameCount + header->blockFrames - 1) / header->blockFrames) {
+            return NULL;
+        }
+        uint64_t tableEnd = sizeof(Header) + ((uint64_t)header->blockCount + 1)*sizeof(uint64_t);
+        if (tableEnd > size) {
+            return NULL;
+        }
+        const uint64_t *offsets = blockOffsets(data);
+        uint64_t last = tableEnd;
+        for (uint32_t b = 0; b <= header->blockCount; b++) {
+            if (offsets[b] < last || offsets[b] > size) {
+                return NULL;
+            }
+            last = offsets[b];
+        }
+        return header;
+    }
+
+    inline int blockLength(const Header &header, int block) {
+        int first = block*header.blockFrames;
+        return std::min((int)header.blockFrames, (int)header.frameCount - first);
+    }
+
+    inline void decodeBlock(const char *data, int block, float *out) {
+        const Header &header = *(const Header*)data;
+        const uint64_t *offsets = blockOffsets(data);
+        int n = blockLength(header, block);
+        int frameSize = header.frameSize;
+        BitReader r(data + offsets[block], data + offsets[block+1]);
+        std::vector<int64_t> keys(n);
+        for (int c = 0; c < frameSize; c++) {
+            keys[0] = (int64_t)r.get(32);
+            int predictor = (int)r.get(2);
+            if (predictor == PREDICT_CONSTANT) {
+                float value = fromKey(keys[0]);
+                for (int t = 0; t < n; t++) {
+                    out[(size_t)t*frameSize + c] = value;
+                }
+                continue;
+            }
+            out[c] = fromKey(keys[0]);
+            int width = 0;
+            for (int t = 1; t < n; t++) {
+                if ((t - 1) % groupSize == 0) {
+                    width = (int)r.get(6);
+                }
+                keys[t] = predict(predictor, keys.data(), t) + unzigzag(r.get(width));
+                out[(size_t)t*frameSize + c] = fromKey(keys[t]);
+            }
+        }
+    }
+
+    inline void decode(const char *data, float *out) {
+        const Header &header = *(const Header*)data;
+        for (uint32_t b = 0; b < header.blockCount; b++) {
+            decodeBlock(data, b, out + (size_t)b*header.blockFrames*header.frameSize);
+        }
+    }
+
+    inline bool write(std::string filename, const FrameSource &clip, int blockFrames) {
+        int frameSize = clip.getLayout().frameSize;
+        std::vector<float> frames((size_t)clip.frameCount()*frameSize);
+        for (int f = 0; f < clip.frameCount(); f++) {
+            const float *values = clip.frame(f);
+            std::copy(values, values + frameSize, frames.begin() + (size_t)f*frameSize);
+        }
+        std::vector<char> encoded;
+        encode(frames.data(), clip.frameCount(), frameSize, encoded, blockFrames);
+        // Written to a temporary file first so a failed write never
+        // leaves a truncated archive behind.
+        std::string tempFilename = filename + ".tmp";
+        std::ofstream out(tempFilename.c_str(), std::ios::binary);
+        out.write(encoded.data(), encoded.size());
+        out.close();
+        if (!out) {
+            std::remove(tempFilename.c_str());
+            return false;
+        }
+        std::remove(filename.c_str());
+        std::rename(tempFilename.c_str(), filename.c_str());
+        return true;
+    }
+
+}
+
+inline ArchivedClip::ArchivedClip() {
+    header = NULL;
+    currentBlock = -1;
+}
+
+inline bool ArchivedClip::open(std::string filename, const ChannelLayout &layout) {
+    this->layout = layout;
+    header = NULL;
+    currentBlock = -1;
+    if (!file.open(filename)) {
+        return false;
+    }
+    header = ClipCodec::validate(file.data(), file.size());
+    if (header && (int)header->frameSize != layout.frameSize) {
+        std::cerr << "Archive " << filename << " has " << header->frameSize
+                  << " channels per frame, the skeleton has " << layout.frameSize << std::endl;
+        header = NULL;
+    }
+    return header != NULL;
+}
+
+inline const float *ArchivedClip::frame(int f) const {
+    int block = f / header->blockFrames;
+    if (block != currentBlock) {
+        values.resize((size_t)header->blockFrames*header->frameSize);
+        ClipCodec::decodeBlock(file.data(), block, values.data());
+        currentBlock = block;
+    }
+    return &values[(size_t)(f % header->blockFrames)*header->frameSize];
+}
+
+#endif
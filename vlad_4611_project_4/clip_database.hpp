@@ -0,0 +1,213 @@
+#ifndef CLIP_DATABASE_HPP
+#define CLIP_DATABASE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "clip.hpp"
+#include "clip_cache.hpp"
+#include "frame_source.hpp"
+#include "mapped_file.hpp"
+
+// Many skeletons and clips packed into one file (.amcdb, written by
+// ClipPacker), so that a whole library is opened and mapped once and
+// switching clips costs no file system calls at all. The file is laid
+// out as
+//
+//     Header
+//     SkeletonEntry[skeletonCount]
+//     ClipEntry[clipCount]
+//     strings                    NUL-terminated names
+//     per skeleton: ClipCache::BoneRecord[boneCount], ClipCache::Link[linkCount]
+//     per clip, page aligned: float[frameCount*frameSize]
+//
+// Skeletons use the same records as the .amcb cache, and each clip's
+// channels are stored exactly as AnimationClip holds them. Native byte
+// order, like the other caches.
+namespace ClipDatabaseFile {
+
+    const uint32_t version = 1;
+    const uint64_t pageSize = 4096;
+
+    struct Header {
+        char magic[4];           // "AMDB"
+        uint32_t version;
+        uint32_t skeletonCount;
+        uint32_t clipCount;
+        uint64_t stringsOffset;
+        uint64_t stringsSize;
+    };
+
+    struct SkeletonEntry {
+        uint32_t name;           // string offset
+        uint32_t degrees;
+        uint32_t boneCount;
+        uint32_t linkCount;
+        float rootPosition[3];
+        float rootOrientation[3];
+        uint64_t bonesOffset;    // BoneRecords, followed by the Links
+    };
+
+    struct ClipEntry {
+        uint32_t name;           // string offset
+        uint32_t skeleton;       // index of its SkeletonEntry
+        uint32_t frameSize;
+        uint32_t frameCount;
+        uint64_t channelOffset;
+    };
+
+}
+
+// A clip inside a mapped ClipDatabase. It points straight into the
+// mapping and stays valid as long as the database is open.
+class DatabaseClip : public FrameSource {
+public:
+    DatabaseClip(std::string name, int skeleton, const ChannelLayout *layout,
+                 const float *frames, int numFrames);
+    int frameCount() const { return numFrames; }
+    const ChannelLayout &getLayout() const { return *layout; }
+    const float *frame(int f) const { return frames + (size_t)f*layout->frameSize; }
+    const std::string &getName() const { return name; }
+    int getSkeleton() const { return skeleton; }
+protected:
+    std::string name;
+    int skeleton;
+    const ChannelLayout *layout;
+    const float *frames;
+    int numFrames;
+};
+
+// Reads a packed clip database. open() maps the file and checks its
+// directory; everything after that works on the mapping.
+class ClipDatabase {
+public:
+    ClipDatabase();
+    // Returns false if the file cannot be mapped or is not a valid
+    // database.
+    bool open(std::string filename);
+
+    int clipCount() const { return (int)clips.size(); }
+    const DatabaseClip &getClip(int c) const { return clips[c]; }
+    // Returns the index of the clip with this name, or -1.
+    int findClip(std::string name) const;
+
+    int skeletonCount() const { return header ? (int)header->skeletonCount : 0; }
+    const ClipDatabaseFile::SkeletonEntry &getSkeleton(int s) const { return skeletons[s]; }
+    std::string getSkeletonName(int s) const { return strings + skeletons[s].name; }
+    const ClipCache::BoneRecord *skeletonBones(int s) const;
+    const ClipCache::Link *skeletonLinks(int s) const;
+
+protected:
+    ClipDatabase(const ClipDatabase&);            // not copyable
+    ClipDatabase &operator=(const ClipDatabase&);
+    MappedFile file;
+    const ClipDatabaseFile::Header *header;
+    const ClipDatabaseFile::SkeletonEntry *skeletons;
+    const char *strings;
+    std::vector<ChannelLayout> layouts; // one per skeleton
+    std::vector<DatabaseClip> clips;
+};
+
+// Definitions below
+
+inline DatabaseClip::DatabaseClip(std::string name, int skeleton, const ChannelLayout *layout,
+                                  const float *frames, int numFrames) {
+    this->name = name;
+    this->skeleton = skeleton;
+    this->layout = layout;
+    this->frames = frames;
+    this->numFrames = numFrames;
+}
+
+inline ClipDatabase::ClipDatabase() {
+    header = NULL;
+    skeletons = NULL;
+    strings = NULL;
+}
+
+inline bool ClipDatabase::open(std::string filename) {
+    using namespace ClipDatabaseFile;
+    header = NULL;
+    layouts.clear();
+    clips.clear();
+    if (!file.open(filename) || file.size() < sizeof(Header)) {
+        return false;
+    }
+    const Header *h = (const Header*)file.data();
+    uint64_t directoryEnd = sizeof(Header) + (uint64_t)h->skeletonCount*sizeof(SkeletonEntry)
+        + (uint64_t)h->clipCount*sizeof(ClipEntry);
+    if (std::memcmp(h->magic, "AMDB", 4) != 0 || h->version != version
+        || h->stringsOffset < directoryEnd || h->stringsSize == 0
+        || h->stringsOffset + h->stringsSize > file.size()
+        || file.data()[h->stringsOffset + h->stringsSize - 1] != 0) {
+        std::cerr << "Not a valid clip database: " << filename << std::endl;
+        return false;
+    }
+    skeletons = (const SkeletonEntry*)(file.data() + sizeof(Header));
+    const ClipEntry *entries = (const ClipEntry*)(skeletons + h->skeletonCount);
+    strings = file.data() + h->stringsOffset;
+
+    // The layouts must not move once clips point at them.
+    layouts.resize(h->skeletonCount);
+    for (uint32_t s = 0; s < h->skeletonCount; s++) {
+        const SkeletonEntry &skeleton = skeletons[s];
+        uint64_t tablesEnd = skeleton.bonesOffset
+            + (uint64_t)skeleton.boneCount*sizeof(ClipCache::BoneRecord)
+            + (uint64_t)skeleton.linkCount*sizeof(ClipCache::Link);
+        if (skeleton.name >= h->stringsSize || tablesEnd > file.size()) {
+            std::cerr << "Clip database " << filename << " is damaged" << std::endl;
+            return false;
+        }
+        const ClipCache::BoneRecord *records =
+            (const ClipCache::BoneRecord*)(file.data() + skeleton.bonesOffset);
+        const ClipCache::Link *links = (const ClipCache::Link*)(records + skeleton.boneCount);
+        if (!ClipCache::linksValid(links, skeleton.linkCount, skeleton.boneCount)) {
+            std::cerr << "Clip database " << filename << " is damaged" << std::endl;
+            return false;
+        }
+        for (uint32_t b = 0; b < skeleton.boneCount; b++) {
+            std::string name(records[b].name, strnlen(records[b].name, sizeof(records[b].name)));
+            uint32_t mask = records[b].dofMask;
+            layouts[s].addBone(name, (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1));
+        }
+    }
+    for (uint32_t c = 0; c < h->clipCount; c++) {
+        const ClipEntry &entry = entries[c];
+        if (entry.name >= h->stringsSize || entry.skeleton >= h->skeletonCount
+            || (int)entry.frameSize != layouts[entry.skeleton].frameSize
+            || entry.channelOffset % sizeof(float) != 0
+            || entry.channelOffset + (uint64_t)entry.frameCount*entry.frameSize*sizeof(float)
+                   > file.size()) {
+            std::cerr << "Clip database " << filename << " is damaged" << std::endl;
+            clips.clear();
+            return false;
+        }
+        clips.push_back(DatabaseClip(strings + entry.name, entry.skeleton,
+                                     &layouts[entry.skeleton],
+                                     (const float*)(file.data() + entry.channelOffset),
+                                     entry.frameCount));
+    }
+    header = h;
+    return true;
+}
+
+inline int ClipDatabase::findClip(std::string name) const {
+    for (int c = 0; c < clips.size(); c++) {
+        if (clips[c].getName() == name) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+inline const ClipCache::BoneRecord *ClipDatabase::skeletonBones(int s) const {
+    return (const ClipCache::BoneRecord*)(file.data() + skeletons[s].bonesOffset);
+}
+
+inline const ClipCache::Link *ClipDatabase::skeletonLinks(int s) const {
+    return (const ClipCache::Link*)(skeletonBones(s) + skeletons[s].boneCount);
+}
+
+#endif
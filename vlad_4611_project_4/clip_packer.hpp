@@ -0,0 +1,219 @@
+#ifndef CLIP_PACKER_HPP
+#define CLIP_PACKER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "asf_file.hpp"
+#include "clip.hpp"
+#include "clip_catalog.hpp"
+#include "clip_database.hpp"
+#include "skeleton.hpp"
+
+// Writes a ClipDatabase file from the clips of a catalog.
+namespace ClipPacker {
+
+    // Packs every clip that has a skeleton, whose channels match it
+    // and that parses; other clips are skipped with a message. Returns false if the
+    // file could not be written.
+    bool pack(std::string filename, const ClipCatalog &catalog);
+
+    // Whether a catalog layout ("root:6 lowerback:3 ...") can be
+    // decoded with a skeleton's channel layout.
+    bool matches(const std::string &catalogLayout, const ChannelLayout &layout);
+
+}
+
+// Definitions below
+
+namespace ClipPacker {
+
+    inline bool matches(const std::string &catalogLayout, const ChannelLayout &layout) {
+        std::istringstream in(catalogLayout);
+        std::string token;
+        while (in >> token) {
+            size_t colon = token.find(':');
+            if (colon == std::string::npos) {
+                return false;
+            }
+            std::string bone = token.substr(0, colon);
+            int values = std::atoi(token.c_str() + colon + 1);
+            if (bone == "root") {
+                if (values != ChannelLayout::rootChannels) {
+                    return false;
+                }
+                continue;
+            }
+            int b = layout.boneIndex(bone);
+            if (b < 0 || layout.dofs[b] != values) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline uint64_t alignUp(uint64_t offset, uint64_t alignment) {
+        return (offset + alignment - 1)/alignment*alignment;
+    }
+
+    // Writes zeros up to the given file offset.
+    inline void padTo(std::ofstream &out, uint64_t offset) {
+        static const char zeros[4096] = {0};
+        uint64_t at = (uint64_t)out.tellp();
+        while (at < offset) {
+            uint64_t n = std::min<uint64_t>(offset - at, sizeof(zeros));
+            out.write(zeros, (std::streamsize)n);
+            at += n;
+        }
+    }
+
+    inline bool pack(std::string filename, const ClipCatalog &catalog) {
+        using namespace ClipDatabaseFile;
+        const std::vector<ClipInfo> &infos = catalog.getClips();
+
+        // Parse every skeleton that clips refer to.
+        std::map<std::string, int> skeletonIndex;
+        std::vector<SkeletonEntry> skeletons;
+        std::vector<ChannelLayout> layouts;
+        std::vector<std::vector<ClipCache::BoneRecord> > records;
+        std::vector<std::vector<ClipCache::Link> > links;
+        std::vector<std::string> skeletonNames;
+        std::vector<int> packed;  // catalog indices of the clips to pack
+        std::vector<int> clipSkeleton;
+        for (int c = 0; c < infos.size(); c++) {
+            const ClipInfo &info = infos[c];
+            if (info.skeleton.empty()) {
+                std::cerr << "Packer: skipping " << info.path << ", no skeleton" << std::endl;
+                continue;
+            }
+            if (!skeletonIndex.count(info.skeleton)) {
+                AsfFile asf;
+                asf.load(catalog.fullPath(info.skeleton));
+                const Skeleton &skeleton = *asf.getSkeleton();
+                SkeletonEntry entry;
+                std::memset(&entry, 0, sizeof(entry));
+                std::vector<ClipCache::BoneRecord> boneRecords;
+                std::vector<ClipCache::Link> boneLinks;
+                if (skeleton.empty() || !skeleton.toRecords(boneRecords, boneLinks)) {
+                    skeletonIndex[info.skeleton] = -1;
+                } else {
+                    entry.degrees = asf.usesDegrees();
+                    entry.boneCount = (uint32_t)boneRecords.size();
+                    entry.linkCount = (uint32_t)boneLinks.size();
+                    glm::vec3 position = asf.getRootPosition();
+                    glm::vec3 orientation = asf.getRootOrientation();
+                    for (int i = 0; i < 3; i++) {
+                        entry.rootPosition[i] = position[i];
+                        entry.rootOrientation[i] = orientation[i];
+                    }
+                    skeletonIndex[info.skeleton] = (int)skeletons.size();
+                    skeletons.push_back(entry);
+                    layouts.push_back(skeleton.getLayout());
+                    records.push_back(boneRecords);
+                    links.push_back(boneLinks);
+                    skeletonNames.push_back(info.skeleton);
+                }
+            }
+            int s = skeletonIndex[info.skeleton];
+            if (s < 0 || info.layout < 0
+                || !matches(catalog.getLayouts()[info.layout], layouts[s])) {
+                std::cerr << "Packer: skipping " << info.path
+                          << ", channels do not match " << info.skeleton << std::endl;
+                continue;
+            }
+            packed.push_back(c);
+            clipSkeleton.push_back(s);
+        }
+
+        // Lay out the directory, strings and skeleton tables.
+        std::string strings;
+        std::vector<ClipEntry> clips(packed.size());
+        for (int s = 0; s < skeletons.size(); s++) {
+            skeletons[s].name = (uint32_t)strings.size();
+            strings += skeletonNames[s] + '\0';
+        }
+        for (int i = 0; i < packed.size(); i++) {
+            std::memset(&clips[i], 0, sizeof(ClipEntry));
+            clips[i].name = (uint32_t)strings.size();
+            strings += infos[packed[i]].name + '\0';
+            clips[i].skeleton = clipSkeleton[i];
+            clips[i].frameSize = layouts[clipSkeleton[i]].frameSize;
+        }
+        strings += '\0';
+        Header header;
+        std::memcpy(header.magic, "AMDB", 4);
+        header.version = version;
+        header.skeletonCount = (uint32_t)skeletons.size();
+        header.clipCount = (uint32_t)clips.size();
+        header.stringsOffset = sizeof(Header) + skeletons.size()*sizeof(SkeletonEntry)
+            + clips.size()*sizeof(ClipEntry);
+        header.stringsSize = strings.size();
+        uint64_t offset = alignUp(header.stringsOffset + header.stringsSize, 8);
+        for (int s = 0; s < skeletons.size(); s++) {
+            skeletons[s].bonesOffset = offset;
+            offset += records[s].size()*sizeof(ClipCache::BoneRecord)
+                + links[s].size()*sizeof(ClipCache::Link);
+            offset = alignUp(offset, 8);
+        }
+
+        // Written to a temporary file first so a crash never leaves a
+        // half-written database behind.
+        std::string tempFilename = filename + ".tmp";
+        std::ofstream out(tempFilename.c_str(), std::ios::binary);
+        if (!out) {
+            std::cerr << "Could not write clip database " << filename << std::endl;
+            return false;
+        }
+        padTo(out, header.stringsOffset); // the directory is written last
+        out.write(strings.data(), strings.size());
+        for (int s = 0; s < skeletons.size(); s++) {
+            padTo(out, skeletons[s].bonesOffset);
+            out.write((const char*)records[s].data(), records[s].size()*sizeof(ClipCache::BoneRecord));
+            out.write((const char*)links[s].data(), links[s].size()*sizeof(ClipCache::Link));
+        }
+        // Clips are decoded one at a time and each starts on a page of
+        // its own. A clip that does not parse is left out of the
+        // directory (its name stays behind in the string table, unused).
+        std::vector<ClipEntry> written;
+        for (int i = 0; i < packed.size(); i++) {
+            AnimationClip clip;
+            if (!clip.load(catalog.fullPath(infos[packed[i]].path), layouts[clips[i].skeleton])) {
+                std::cerr << "Packer: skipping " << infos[packed[i]].path
+                          << ", no frames could be read" << std::endl;
+                continue;
+            }
+            offset = alignUp((uint64_t)out.tellp(), pageSize);
+            padTo(out, offset);
+            clips[i].channelOffset = offset;
+            clips[i].frameCount = clip.frameCount();
+            out.write((const char*)clip.frames(),
+                      (std::streamsize)clip.frameCount()*clips[i].frameSize*sizeof(float));
+            written.push_back(clips[i]);
+        }
+        header.clipCount = (uint32_t)written.size();
+        out.seekp(0);
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)skeletons.data(), skeletons.size()*sizeof(SkeletonEntry));
+        out.write((const char*)written.data(), written.size()*sizeof(ClipEntry));
+        out.close();
+        if (!out) {
+            std::remove(tempFilename.c_str());
+            return false;
+        }
+        std::remove(filename.c_str());
+        std::rename(tempFilename.c_str(), filename.c_str());
+        std::cerr << "Packed " << written.size() << " clips and " << skeletons.size()
+                  << " skeletons into " << filename << std::endl;
+        return true;
+    }
+
+}
+
+#endif
@@ -3,11 +3,42 @@
 
 #include <string>
 #include <glm/glm.hpp>
+#include "frame_source.hpp"
 
 namespace Config {
 
+    // PLAYBACK_STREAM reads the AMC file frame by frame from disk
+    // instead of loading the whole clip (for clips too long to
+    // preload). A background thread keeps streamBufferFrames frames
+    // in memory, decoding up to streamReadAhead of them ahead of the
+    // playhead; watch stderr for underruns when tuning these.
+    // PLAYBACK_FOLLOW previews a file that the capture
+    // system is still writing, staying liveLatency seconds behind
+    // its newest frame.
+    const PlaybackMode playbackMode = PLAYBACK_PRELOAD;
+    const float liveLatency = 0.025f;
+    const int streamBufferFrames = 1200;
+    const int streamReadAhead = 240;
+
+    // With a positive lossyTolerance (in meters), a preloaded clip is
+    // compressed for playback so that no joint strays further than
+    // that from the original motion. The ratio and the error reached
+    // are printed to stderr.
+    const float lossyTolerance = 0;
+
     const std::string dataDir = "C:\\Users\\Computron\\Documents\\Visual Studio 2017\\Projects\\vlad_4611_project_4\\vlad_4611_project_4\\data";
 
+    // Set to the name of a clip in dataDir (e.g. "143_35") to play it
+    // with its subject's skeleton instead of the files below. Clips
+    // are found through the catalog that is kept in dataDir (see
+    // clip_catalog.hpp).
+    const std::string clipName = "";
+
+    // Set to the path of a packed clip database to play clipName out
+    // of it (see clip_database.hpp). If the file does not exist yet,
+    // it is packed from every clip in dataDir.
+    const std::string databaseFile = "";
+
     // Walk cycle
     const std::string asfFile = dataDir + "/08.asf";
     const std::string amcFile = dataDir + "/08_01_cycle.amc";
@@ -0,0 +1,181 @@
+#ifndef CROWD_KINEMATICS_HPP
+#define CROWD_KINEMATICS_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include "float_lanes.hpp"
+#include "pose.hpp"
+#include "skeleton.hpp"
+
+// Forward kinematics for many characters that share one skeleton, the
+// same result as Pose::evaluate() for each of them.
+//
+// Characters go through in groups of as many as fit in a SIMD register
+// (L = FloatLanes::WIDTH: 8 with AVX, 4 with SSE), with the
+// transforms of the group laid out side by side, lane i belonging to
+// character i. The hierarchy is walked once per group, and every step
+// of it (quaternion to matrix, parent times local, bone end) works on
+// all L characters with one instruction. Bone vectors are the same
+// for everyone, so they are broadcast rather than loaded.
+//
+// evaluate<ScalarLanes>() is the same kernel one character at a time,
+// for checking and for targets without SSE.
+class CrowdKinematics {
+public:
+    // Computes poses[i] from frames[i] and roots[i] for i < count.
+    void evaluate(const Skeleton &skeleton, int count, const glm::mat4x3 *roots,
+                  const float *const *frames, Pose *poses);
+    template <typename V>
+    void evaluate(const Skeleton &skeleton, int count, const glm::mat4x3 *roots,
+                  const float *const *frames, Pose *poses);
+
+protected:
+    // A 3-vector for every lane, x, y and z stored L floats apart.
+    template <typename V>
+    struct Column {
+        V x, y, z;
+        static Column load(const float *p, int L) {
+            Column c = {V::load(p), V::load(p + L), V::load(p + 2*L)};
+            return c;
+        }
+        void store(float *p, int L) const {
+            x.store(p);
+            y.store(p + L);
+            z.store(p + 2*L);
+        }
+    };
+    // a*u + b*v + c*w, the product of the matrix with columns a, b, c
+    // and the vector (u, v, w).
+    template <typename V>
+    static Column<V> combine(const Column<V> &a, const Column<V> &b, const Column<V> &c,
+                             const V &u, const V &v, const V &w);
+
+    // Per bone, the basis (3 columns) and end of each lane's bone:
+    // 12 rows of lanes, with the roots first.
+    std::vector<float> slots;
+};
+
+// Definitions below
+
+inline void CrowdKinematics::evaluate(const Skeleton &skeleton, int count, const glm::mat4x3 *roots,
+                                      const float *const *frames, Pose *poses) {
+    evaluate<FloatLanes>(skeleton, count, roots, frames, poses);
+}
+
+template <typename V>
+inline CrowdKinematics::Column<V> CrowdKinematics::combine(const Column<V> &a, const Column<V> &b,
+                                                           const Column<V> &c, const V &u,
+                                                           const V &v, const V &w) {
+    Column<V> r = {a.x*u + b.x*v + c.x*w, a.y*u + b.y*v + c.y*w, a.z*u + b.z*v + c.z*w};
+    return r;
+}
+
+template <typename V>
+inline void CrowdKinematics::evaluate(const Skeleton &skeleton, int count, const glm::mat4x3 *roots,
+                                      const float *const *frames, Pose *poses) {
+    const int L = V::WIDTH, ROW = 12*L;
+    int n = skeleton.boneCount();
+    int frameSize = skeleton.getLayout().frameSize;
+    slots.resize((size_t)(n + 1)*ROW);
+    float *rows = slots.data();
+    for (int i = 0; i < count; i++) {
+        Pose &pose = poses[i];
+        pose.root = roots[i];
+        pose.channels.assign(frames[i], frames[i] + frameSize);
+        pose.local.resize(n);
+        pose.world.resize(n);
+        pose.end.resize(n);
+    }
+
+    for (int first = 0; first < count; first += L) {
+        // Lanes past the last character repeat it and are not stored.
+        int lanes = count - first < L ? count - first : L;
+        Pose *group = poses + first;
+        const float *frame[L];
+        for (int lane = 0; lane < L; lane++) {
+            int i = first + (lane < lanes ? lane : lanes - 1);
+            frame[lane] = frames[i];
+            for (int k = 0; k < 12; k++) {
+                rows[k*L + lane] = roots[i][k/3][k%3];
+            }
+        }
+        for (int b = 0; b < n; b++) {
+            const float *p = rows + (skeleton.parent[b] + 1)*ROW;
+            float *w = rows + (b + 1)*ROW;
+
+            // Sines and cosines of the half angles (this loop
+            // vectorizes as it is), then the local rotation
+            // bind * qz*qy*qx * bind^-1 as in EulerKernel.
+            float angles[L][3], half[3][L], sine[3][L], cosine[3][L];
+            DofDecode decode = skeleton.decoder[b];
+            for (int lane = 0; lane < L; lane++) {
+                decode(frame[lane] + skeleton.channelOffset[b], angles[lane]);
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                for (int lane = 0; lane < L; lane++) {
+                    half[axis][lane] = 0.5f*angles[lane][axis];
+                }
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                for (int lane = 0; lane < L; lane++) {
+                    sinCosDegrees(half[axis][lane], sine[axis][lane], cosine[axis][lane]);
+                }
+            }
+            V sx = V::load(sine[0]), cx = V::load(cosine[0]), sy = V::load(sine[1]);
+            V cy = V::load(cosine[1]), sz = V::load(sine[2]), cz = V::load(cosine[2]);
+            V ew = cz*cy*cx + sz*sy*sx;
+            V ex = cz*cy*sx - sz*sy*cx;
+            V ey = cz*sy*cx + sz*cy*sx;
+            V ez = sz*cy*cx - cz*sy*sx;
+            const glm::quat &bind = skeleton.bindRotation[b];
+            V bw = V::broadcast(bind.w), bx = V::broadcast(bind.x);
+            V by = V::broadcast(bind.y), bz = V::broadcast(bind.z);
+            V pw = bw*ew - bx*ex - by*ey - bz*ez;
+            V px = bw*ex + bx*ew + by*ez - bz*ey;
+            V py = bw*ey - bx*ez + by*ew + bz*ex;
+            V pz = bw*ez + bx*ey - by*ex + bz*ew;
+            V zero = V::broadcast(0.f);
+            V qw = pw*bw + px*bx + py*by + pz*bz;
+            V qx = zero - pw*bx + px*bw - py*bz + pz*by;
+            V qy = zero - pw*by + px*bz + py*bw - pz*bx;
+            V qz = zero - pw*bz - px*by + py*bx + pz*bw;
+
+            V one = V::broadcast(1.f), two = V::broadcast(2.f);
+            Column<V> r0 = {one - two*(qy*qy + qz*qz), two*(qx*qy + qw*qz), two*(qx*qz - qw*qy)};
+            Column<V> r1 = {two*(qx*qy - qw*qz), one - two*(qx*qx + qz*qz), two*(qy*qz + qw*qx)};
+            Column<V> r2 = {two*(qx*qz + qw*qy), two*(qy*qz - qw*qx), one - two*(qx*qx + qy*qy)};
+            Column<V> p0 = Column<V>::load(p, L), p1 = Column<V>::load(p + 3*L, L);
+            Column<V> p2 = Column<V>::load(p + 6*L, L), origin = Column<V>::load(p + 9*L, L);
+            // The world basis is parent * r.
+            Column<V> w0 = combine(p0, p1, p2, r0.x, r0.y, r0.z);
+            Column<V> w1 = combine(p0, p1, p2, r1.x, r1.y, r1.z);
+            Column<V> w2 = combine(p0, p1, p2, r2.x, r2.y, r2.z);
+            const glm::vec3 &v = skeleton.boneVector[b];
+            Column<V> end = combine(w0, w1, w2, V::broadcast(v.x), V::broadcast(v.y), V::broadcast(v.z));
+            end.x = origin.x + end.x;
+            end.y = origin.y + end.y;
+            end.z = origin.z + end.z;
+            w0.store(w, L);
+            w1.store(w + 3*L, L);
+            w2.store(w + 6*L, L);
+            end.store(w + 9*L, L);
+
+            float q[4][L];
+            qw.store(q[0]);
+            qx.store(q[1]);
+            qy.store(q[2]);
+            qz.store(q[3]);
+            for (int lane = 0; lane < lanes; lane++) {
+                const float *c = w + lane;
+                group[lane].local[b] = glm::quat(q[0][lane], q[1][lane], q[2][lane], q[3][lane]);
+                group[lane].world[b] = glm::mat4x3(c[0], c[L], c[2*L], c[3*L], c[4*L], c[5*L],
+                                                   c[6*L], c[7*L], c[8*L],
+                                                   p[9*L + lane], p[10*L + lane], p[11*L + lane]);
+                group[lane].end[b] = glm::vec3(c[9*L], c[10*L], c[11*L]);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef DOF_DECODER_HPP
+#define DOF_DECODER_HPP
+
+// How the channels of a bone map to its rotation angles. A bone has a
+// dof mask (bit 0 for rx, 1 for ry, 2 for rz) and one channel per set
+// bit, in x, y, z order, so there are only eight ways to read it; each
+// is a separate instance of DofDecoder, with the mask known at compile
+// time, so reading a bone does not test its flags.
+//
+// Skeleton looks the decoder of each bone up once, when it is built
+// (dofDecoder()), and then decodes a frame by calling them in turn.
+// Frames are channel values whichever source they come from (AMC text,
+// cache, database, stream), so the same decoders serve all of them.
+template <int MASK>
+struct DofDecoder {
+    enum { DOFS = (MASK & 1) + ((MASK >> 1) & 1) + ((MASK >> 2) & 1) };
+
+    // Writes rx, ry and rz, with 0 for the axes the bone does not
+    // have, from the bone's channel values.
+    static void decode(const float *values, float *angles) {
+        angles[0] = (MASK & 1) ? values[0] : 0.f;
+        angles[1] = (MASK & 2) ? values[MASK & 1] : 0.f;
+        angles[2] = (MASK & 4) ? values[(MASK & 1) + ((MASK >> 1) & 1)] : 0.f;
+    }
+
+    // The axis (0 for x, 1 for y, 2 for z) of the bone's dof-th
+    // channel, or -1 past the last one.
+    static int axis(int dof) {
+        static const int axes[4] = {
+            (MASK & 1) ? 0 : (MASK & 2) ? 1 : (MASK & 4) ? 2 : -1,
+            (MASK & 3) == 3 ? 1 : (MASK & 5) == 5 || (MASK & 6) == 6 ? 2 : -1,
+            MASK == 7 ? 2 : -1,
+            -1
+        };
+        return dof >= 0 && dof < 3 ? axes[dof] : -1;
+    }
+};
+
+typedef void (*DofDecode)(const float *values, float *angles);
+
+// The decoder for a mask (0 to 7).
+inline DofDecode dofDecoder(int mask) {
+    static const DofDecode decoders[8] = {
+        &DofDecoder<0>::decode, &DofDecoder<1>::decode, &DofDecoder<2>::decode, &DofDecoder<3>::decode,
+        &DofDecoder<4>::decode, &DofDecoder<5>::decode, &DofDecoder<6>::decode, &DofDecoder<7>::decode
+    };
+    return decoders[mask & 7];
+}
+
+// DofDecoder<mask>::axis(dof).
+inline int dofAxis(int mask, int dof) {
+    typedef int (*Axis)(int);
+    static const Axis axes[8] = {
+        &DofDecoder<0>::axis, &DofDecoder<1>::axis, &DofDecoder<2>::axis, &DofDecoder<3>::axis,
+        &DofDecoder<4>::axis, &DofDecoder<5>::axis, &DofDecoder<6>::axis, &DofDecoder<7>::axis
+    };
+    return axes[mask & 7](dof);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef FLOAT_LANES_HPP
+#define FLOAT_LANES_HPP
+
+// A few floats that are added and multiplied together, one SIMD
+// register's worth, so that a kernel can be written once as a template
+// over the lane type and compiled for AVX (8 lanes), SSE (4 lanes) or
+// plain floats (1 lane). Loads and stores are unaligned.
+//
+// FloatLanes is the widest type the compiler targets: AVX needs /arch:AVX
+// (or -mavx), SSE is always there on x64. Define FLOAT_LANES_SCALAR to
+// use plain floats anyway.
+
+#if !defined(FLOAT_LANES_SCALAR) && defined(__AVX__)
+#define FLOAT_LANES_AVX
+#include <immintrin.h>
+#elif !defined(FLOAT_LANES_SCALAR) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FLOAT_LANES_SSE
+#include <emmintrin.h>
+#endif
+
+struct ScalarLanes {
+    enum { WIDTH = 1 };
+    float v;
+    static ScalarLanes load(const float *p) { ScalarLanes r; r.v = *p; return r; }
+    static ScalarLanes broadcast(float x) { ScalarLanes r; r.v = x; return r; }
+    void store(float *p) const { *p = v; }
+};
+inline ScalarLanes operator+(const ScalarLanes &a, const ScalarLanes &b) { ScalarLanes r; r.v = a.v + b.v; return r; }
+inline ScalarLanes operator-(const ScalarLanes &a, const ScalarLanes &b) { ScalarLanes r; r.v = a.v - b.v; return r; }
+inline ScalarLanes operator*(const ScalarLanes &a, const ScalarLanes &b) { ScalarLanes r; r.v = a.v * b.v; return r; }
+
+#if defined(FLOAT_LANES_SSE) || defined(FLOAT_LANES_AVX)
+struct SseLanes {
+    enum { WIDTH = 4 };
+    __m128 v;
+    static SseLanes load(const float *p) { SseLanes r; r.v = _mm_loadu_ps(p); return r; }
+    static SseLanes broadcast(float x) { SseLanes r; r.v = _mm_set1_ps(x); return r; }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+inline SseLanes operator+(const SseLanes &a, const SseLanes &b) { SseLanes r; r.v = _mm_add_ps(a.v, b.v); return r; }
+inline SseLanes operator-(const SseLanes &a, const SseLanes &b) { SseLanes r; r.v = _mm_sub_ps(a.v, b.v); return r; }
+inline SseLanes operator*(const SseLanes &a, const SseLanes &b) { SseLanes r; r.v = _mm_mul_ps(a.v, b.v); return r; }
+#endif
+
+#ifdef FLOAT_LANES_AVX
+struct AvxLanes {
+    enum { WIDTH = 8 };
+    __m256 v;
+    static AvxLanes load(const float *p) { AvxLanes r; r.v = _mm256_loadu_ps(p); return r; }
+    static AvxLanes broadcast(float x) { AvxLanes r; r.v = _mm256_set1_ps(x); return r; }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+inline AvxLanes operator+(const AvxLanes &a, const AvxLanes &b) { AvxLanes r; r.v = _mm256_add_ps(a.v, b.v); return r; }
+inline AvxLanes operator-(const AvxLanes &a, const AvxLanes &b) { AvxLanes r; r.v = _mm256_sub_ps(a.v, b.v); return r; }
+inline AvxLanes operator*(const AvxLanes &a, const AvxLanes &b) { AvxLanes r; r.v = _mm256_mul_ps(a.v, b.v); return r; }
+typedef AvxLanes FloatLanes;
+#elif defined(FLOAT_LANES_SSE)
+typedef SseLanes FloatLanes;
+#else
+typedef ScalarLanes FloatLanes;
+#endif
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef FORWARD_STEP_HPP
+#define FORWARD_STEP_HPP
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#ifdef _MSC_VER
+#define FORWARD_STEP_INLINE __forceinline
+#else
+#define FORWARD_STEP_INLINE inline __attribute__((always_inline))
+#endif
+
+// One bone of forward kinematics: the bone starts at origin in its
+// parent's frame start, turns by local, and runs along boneVector.
+// Sets its world frame (basis start * local, at origin) and its end.
+//
+// This is the same arithmetic, in the same order, as
+// glm::mat3(start) * glm::mat3_cast(local) followed by a matrix-vector
+// product, written out in floats and always inlined, however many
+// times a caller repeats it (CmuForwardChain has one per bone).
+FORWARD_STEP_INLINE void forwardStep(const glm::mat4x3 &start, const glm::vec3 &origin, const glm::quat &local,
+                        const glm::vec3 &boneVector, glm::mat4x3 &world, glm::vec3 &end) {
+    float qxx = local.x*local.x, qyy = local.y*local.y, qzz = local.z*local.z;
+    float qxz = local.x*local.z, qxy = local.x*local.y, qyz = local.y*local.z;
+    float qwx = local.w*local.x, qwy = local.w*local.y, qwz = local.w*local.z;
+    glm::vec3 r0(1.f - 2.f*(qyy + qzz), 2.f*(qxy + qwz), 2.f*(qxz - qwy));
+    glm::vec3 r1(2.f*(qxy - qwz), 1.f - 2.f*(qxx + qzz), 2.f*(qyz + qwx));
+    glm::vec3 r2(2.f*(qxz + qwy), 2.f*(qyz - qwx), 1.f - 2.f*(qxx + qyy));
+    glm::vec3 s0 = start[0], s1 = start[1], s2 = start[2];
+    glm::vec3 w0(s0.x*r0.x + s1.x*r0.y + s2.x*r0.z,
+                 s0.y*r0.x + s1.y*r0.y + s2.y*r0.z,
+                 s0.z*r0.x + s1.z*r0.y + s2.z*r0.z);
+    glm::vec3 w1(s0.x*r1.x + s1.x*r1.y + s2.x*r1.z,
+                 s0.y*r1.x + s1.y*r1.y + s2.y*r1.z,
+                 s0.z*r1.x + s1.z*r1.y + s2.z*r1.z);
+    glm::vec3 w2(s0.x*r2.x + s1.x*r2.y + s2.x*r2.z,
+                 s0.y*r2.x + s1.y*r2.y + s2.y*r2.z,
+                 s0.z*r2.x + s1.z*r2.y + s2.z*r2.z);
+    const glm::vec3 &v = boneVector;
+    end = glm::vec3(origin.x + (w0.x*v.x + w1.x*v.y + w2.x*v.z),
+                    origin.y + (w0.y*v.x + w1.y*v.y + w2.y*v.z),
+                    origin.z + (w0.z*v.x + w1.z*v.y + w2.z*v.z));
+    world = glm::mat4x3(w0, w1, w2, origin);
+}
+
+#endif
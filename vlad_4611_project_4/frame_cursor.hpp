@@ -0,0 +1,335 @@
+#ifndef FRAME_CURSOR_HPP
+#define FRAME_CURSOR_HPP
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include "clip.hpp"
+#include "frame_source.hpp"
+#include "live_clip.hpp"
+#include "mapped_reader.hpp"
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#define FRAME_CURSOR_COROUTINES 1
+#endif
+#endif
+
+// One decoded frame: frameSize channel values in the order of the
+// layout. Views are cheap to copy; the values stay valid until the
+// cursor that produced them moves on.
+struct FrameView {
+    int index;             // frame number, counting from 0
+    const float *values;
+    const ChannelLayout *layout;
+    int size() const { return layout->frameSize; }
+    float operator[](int c) const { return values[c]; }
+};
+
+// Reads an AMC file from start to end in blocks, decoding one frame
+// at a time. Unlike StreamedClip it keeps no index, so memory use does
+// not depend on the length of the file: a session of any size is
+// read with one block and one frame of values.
+class AmcFrameReader {
+public:
+    AmcFrameReader();
+    // Returns false if the file cannot be opened.
+    bool open(std::string amcFilename, const ChannelLayout &layout);
+    // Decodes the next frame into values. Returns false at the end.
+    bool read(std::vector<float> &values);
+    const ChannelLayout &getLayout() const { return layout; }
+protected:
+    // Reads another block, keeping the bytes not parsed yet. Returns
+    // false once there is nothing left to parse.
+    bool fill();
+    static const size_t blockSize = 1 << 20;
+    std::ifstream in;
+    ChannelLayout layout;
+    ChannelSchema schema;
+    std::vector<char> buffer;
+    size_t start;     // next byte to parse
+    size_t complete;  // bytes before this hold whole frames only
+    bool header;      // still in the header
+    bool atEnd;       // the whole file has been read into the buffer
+};
+
+// Pulls frames one by one out of any source: a clip in memory or in a
+// database, a file read on demand (StreamedClip, ArchivedClip), an
+// AMC file read sequentially (AmcFrameReader) or a file being written
+// (LiveClip). It keeps its own position and never touches a Character,
+// so batch tools can run through clips without any rendering state.
+//
+//     FrameCursor cursor(clip);
+//     for (FrameView frame : cursor) { ... }
+//
+// or, one at a time, while (cursor.next(frame)) { ... }.
+class FrameCursor {
+public:
+    class iterator;
+
+    // Frames [first, source.frameCount()) of a source that outlives
+    // the cursor.
+    explicit FrameCursor(const FrameSource &source, int first = 0);
+    // A live file: at the end, the cursor polls the clip for frames
+    // written since, and stops only when there are none. next() may
+    // be called again later to continue.
+    explicit FrameCursor(LiveClip &clip, int first = 0);
+    // An AMC file, read sequentially in constant memory. Yields
+    // nothing if it cannot be opened.
+    FrameCursor(std::string amcFilename, const ChannelLayout &layout);
+
+    // Moves to the next frame. Returns false at the end.
+    bool next(FrameView &view);
+    const ChannelLayout &getLayout() const;
+
+    iterator begin();
+    iterator end();
+
+protected:
+    FrameCursor(const FrameCursor&);            // holds a position
+    FrameCursor &operator=(const FrameCursor&);
+    const FrameSource *source;
+    LiveClip *live;
+    std::unique_ptr<AmcFrameReader> reader;
+    std::vector<float> values;  // the current frame, for reader
+    int position;               // index of the next frame
+};
+
+// Input iterator over a FrameCursor; dereferences to the current view.
+class FrameCursor::iterator {
+public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef FrameView value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const FrameView *pointer;
+    typedef const FrameView &reference;
+
+    iterator() : cursor(NULL) {}
+    explicit iterator(FrameCursor *cursor) : cursor(cursor) { ++*this; }
+    const FrameView &operator*() const { return view; }
+    const FrameView *operator->() const { return &view; }
+    iterator &operator++() {
+        if (!cursor->next(view)) {
+            cursor = NULL;
+        }
+        return *this;
+    }
+    bool operator==(const iterator &other) const { return cursor == other.cursor; }
+    bool operator!=(const iterator &other) const { return cursor != other.cursor; }
+protected:
+    FrameCursor *cursor;  // NULL at the end
+    FrameView view;
+};
+
+#ifdef FRAME_CURSOR_COROUTINES
+
+// The same frames as a C++20 generator, for writing filters as
+// coroutines that pull from one another:
+//
+//     FrameGenerator everyOther(FrameGenerator frames) {
+//         for (FrameView frame : frames)
+//             if (frame.index % 2 == 0) co_yield frame;
+//     }
+//
+// Nothing runs until the first frame is asked for.
+class FrameGenerator {
+public:
+    struct promise_type {
+        FrameView current;
+        FrameGenerator get_return_object() {
+            return FrameGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(FrameView view) {
+            current = view;
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    class iterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef FrameView value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const FrameView *pointer;
+        typedef const FrameView &reference;
+        iterator() {}
+        explicit iterator(Handle handle) : handle(handle) {}
+        const FrameView &operator*() const { return handle.promise().current; }
+        const FrameView *operator->() const { return &handle.promise().current; }
+        iterator &operator++() {
+            handle.resume();
+            return *this;
+        }
+        bool operator==(const iterator &) const { return !handle || handle.done(); }
+        bool operator!=(const iterator &other) const { return !(*this == other); }
+    protected:
+        Handle handle;
+    };
+
+    FrameGenerator(FrameGenerator &&other) noexcept : handle(other.handle) { other.handle = {}; }
+    ~FrameGenerator() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+    iterator begin() {
+        handle.resume();
+        return iterator(handle);
+    }
+    iterator end() { return iterator(); }
+
+protected:
+    explicit FrameGenerator(Handle handle) : handle(handle) {}
+    FrameGenerator(const FrameGenerator&) = delete;
+    FrameGenerator &operator=(const FrameGenerator&) = delete;
+    Handle handle;
+};
+
+// Yields every frame the cursor has left.
+inline FrameGenerator generateFrames(FrameCursor &cursor) {
+    FrameView view;
+    while (cursor.next(view)) {
+        co_yield view;
+    }
+}
+
+#endif
+
+// Definitions below
+
+inline AmcFrameReader::AmcFrameReader() {
+    start = complete = 0;
+    header = true;
+    atEnd = true;
+}
+
+inline bool AmcFrameReader::open(std::string amcFilename, const ChannelLayout &layout) {
+    this->layout = layout;
+    schema = ChannelSchema();
+    buffer.clear();
+    start = complete = 0;
+    header = true;
+    in.close();
+    in.clear();
+    in.open(amcFilename.c_str(), std::ios::binary);
+    atEnd = !in;
+    return !atEnd;
+}
+
+inline bool AmcFrameReader::fill() {
+    buffer.erase(buffer.begin(), buffer.begin() + start);
+    start = 0;
+    while (!atEnd) {
+        size_t old = buffer.size();
+        buffer.resize(old + blockSize);
+        in.read(&buffer[old], blockSize);
+        buffer.resize(old + (size_t)in.gcount());
+        if (buffer.size() == old) {
+            atEnd = true;
+            break;
+        }
+        // Frames start at the lines that begin with a digit. The header
+        // ends at the first one.
+        const char *data = buffer.data();
+        size_t from = old > 0 ? old - 1 : 0;
+        if (header) {
+            for (size_t i = from; i < buffer.size(); i++) {
+                if ((i == 0 || data[i-1] == '\n') && data[i] >= '0' && data[i] <= '9') {
+                    header = false;
+                    start = i;
+                    break;
+                }
+            }
+            if (header) {
+                continue;
+            }
+        }
+        // Everything before the last frame start is whole frames.
+        for (size_t i = buffer.size() - 1; i > start && i > from; i--) {
+            if (data[i-1] == '\n' && data[i] >= '0' && data[i] <= '9') {
+                complete = i;
+                return true;
+            }
+        }
+    }
+    complete = header ? start : buffer.size();
+    return start < complete;
+}
+
+inline bool AmcFrameReader::read(std::vector<float> &values) {
+    while (true) {
+        if (start < complete) {
+            MappedReader r(buffer.data() + start, buffer.data() + complete);
+            values.clear();
+            int n = AnimationClip::parseFrames(r, layout, schema, values, 1);
+            start = n > 0 ? r.position() - buffer.data() : complete;
+            if (n > 0) {
+                return true;
+            }
+        }
+        if (!fill()) {
+            return false;
+        }
+    }
+}
+
+inline FrameCursor::FrameCursor(const FrameSource &source, int first) {
+    this->source = &source;
+    live = NULL;
+    position = first;
+}
+
+inline FrameCursor::FrameCursor(LiveClip &clip, int first) {
+    source = &clip;
+    live = &clip;
+    position = first;
+}
+
+inline FrameCursor::FrameCursor(std::string amcFilename, const ChannelLayout &layout) {
+    source = NULL;
+    live = NULL;
+    position = 0;
+    reader.reset(new AmcFrameReader);
+    reader->open(amcFilename, layout);
+}
+
+inline bool FrameCursor::next(FrameView &view) {
+    if (reader) {
+        if (!reader->read(values)) {
+            return false;
+        }
+        view.values = values.data();
+    } else {
+        if (position >= source->frameCount() && !(live && live->poll() > 0)) {
+            return false;
+        }
+        view.values = source->frame(position);
+    }
+    view.index = position++;
+    view.layout = &getLayout();
+    return true;
+}
+
+inline const ChannelLayout &FrameCursor::getLayout() const {
+    return reader ? reader->getLayout() : source->getLayout();
+}
+
+inline FrameCursor::iterator FrameCursor::begin() {
+    return iterator(this);
+}
+
+inline FrameCursor::iterator FrameCursor::end() {
+    return iterator();
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef FRAME_SOURCE_HPP
+#define FRAME_SOURCE_HPP
+
+class ChannelLayout;
+
+// How a Character plays its AMC file.
+enum PlaybackMode {
+    PLAYBACK_PRELOAD,  // decode the whole clip (or map its cache) up front
+    PLAYBACK_STREAM,   // read frames from disk on demand (StreamedClip)
+    PLAYBACK_FOLLOW    // follow a file that is still being written (LiveClip)
+};
+
+// A playback mode and its settings.
+struct PlaybackOptions {
+    PlaybackMode mode;
+    // PLAYBACK_FOLLOW: seconds to stay behind the newest frame.
+    float liveLatency;
+    // PLAYBACK_STREAM: frames held by the BufferedClip ring and how
+    // many of them are decoded ahead of the playhead. With
+    // bufferFrames = 0, frames are read on the render thread instead.
+    int bufferFrames;
+    int readAhead;
+    // PLAYBACK_PRELOAD: if > 0, the clip is compressed (LossyClip) so
+    // that no joint moves more than this many meters.
+    float lossyTolerance;
+
+    PlaybackOptions(PlaybackMode mode = PLAYBACK_PRELOAD) {
+        this->mode = mode;
+        liveLatency = 0;
+        bufferFrames = 0;
+        readAhead = 0;
+        lossyTolerance = 0;
+    }
+};
+
+// Anything a Character can play mocap frames from: a clip decoded in
+// memory, a file read frame by frame, and so on. Frames are numbered
+// from 0 and hold ChannelLayout::frameSize values each.
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+    virtual int frameCount() const = 0;
+    virtual const ChannelLayout &getLayout() const = 0;
+    // Returns the channel values of frame f, 0 <= f < frameCount().
+    // The pointer may be invalidated by the next call.
+    virtual const float *frame(int f) const = 0;
+    // Whether frames cost the same in any order, so that several
+    // characters at different places in the clip can share the source.
+    // Sources that read ahead of one playhead or decode a block at a
+    // time say no.
+    virtual bool randomAccess() const { return true; }
+};
+
+#endif
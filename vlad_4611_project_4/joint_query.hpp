@@ -0,0 +1,140 @@
+#ifndef JOINT_QUERY_HPP
+#define JOINT_QUERY_HPP
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include "euler_kernel.hpp"
+#include "forward_step.hpp"
+#include "skeleton.hpp"
+
+// Positions of a few joints (the ends of some target bones) without
+// posing the whole skeleton, for foot contacts, camera follow and the
+// like. The query works out once which bones the targets hang from and
+// sets up an EulerKernel for just those; evaluate() then decodes and
+// chains only them, so a frame costs in proportion to the bones on the
+// way to the targets (a foot is 4 bones of the 30 of a CMU skeleton),
+// not to the skeleton.
+//
+// The positions are the same as Pose::end of the target bones.
+class JointQuery {
+public:
+    // targets are bone indices of skeleton, which must outlive the
+    // query and not change.
+    JointQuery(const Skeleton &skeleton, const std::vector<int> &targets);
+    // The same with bone names; aborts on a name the skeleton does not
+    // have.
+    JointQuery(const Skeleton &skeleton, const std::vector<std::string> &targetNames);
+
+    // joints[i] is the end of the i-th target for a frame of channel
+    // values (in the layout of skeleton.getLayout()).
+    void evaluate(const glm::mat4x3 &root, const float *frame, glm::vec3 *joints);
+    // The same for frameCount consecutive frames, frameSize floats
+    // apart; joints has targetCount() entries per frame.
+    void evaluate(const glm::mat4x3 *roots, const float *frames, int frameCount, int frameSize,
+                  glm::vec3 *joints);
+
+    int targetCount() const { return (int)target.size(); }
+    // How many bones evaluate() goes through.
+    int chainLength() const { return (int)bone.size(); }
+
+protected:
+    void build(const std::vector<int> &targets);
+
+    const Skeleton &skeleton;
+    // The targets and their ancestors in hierarchy order, so parents
+    // come first; parentSlot is where the parent is in this list, or
+    // -1 for bones on the root.
+    std::vector<int> bone;
+    std::vector<int> parentSlot;
+    std::vector<int> target;            // slot of each target
+    EulerKernel kernel;                 // for the bones in the list
+    std::vector<glm::quat> local;       // per slot
+    std::vector<glm::mat4x3> world;     // per slot
+    std::vector<glm::vec3> end;         // per slot
+};
+
+// Definitions below
+
+inline JointQuery::JointQuery(const Skeleton &skeleton, const std::vector<int> &targets)
+    : skeleton(skeleton) {
+    build(targets);
+}
+
+inline JointQuery::JointQuery(const Skeleton &skeleton, const std::vector<std::string> &targetNames)
+    : skeleton(skeleton) {
+    std::vector<int> targets;
+    for (size_t i = 0; i < targetNames.size(); i++) {
+        int b = skeleton.findBone(targetNames[i]);
+        if (b < 0) {
+            std::cerr << "JointQuery: no bone named " << targetNames[i] << std::endl;
+            std::abort();
+        }
+        targets.push_back(b);
+    }
+    build(targets);
+}
+
+inline void JointQuery::build(const std::vector<int> &targets) {
+    int n = skeleton.boneCount();
+    // Mark the targets and everything above them; bones are in
+    // hierarchy order, so taking the marked ones in index order puts
+    // every parent before its children.
+    std::vector<bool> needed(n, false);
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (targets[i] < 0 || targets[i] >= n) {
+            std::cerr << "JointQuery: bad bone index " << targets[i] << std::endl;
+            std::abort();
+        }
+        for (int b = targets[i]; b >= 0 && !needed[b]; b = skeleton.parent[b]) {
+            needed[b] = true;
+        }
+    }
+    std::vector<int> slot(n, -1);
+    for (int b = 0; b < n; b++) {
+        if (needed[b]) {
+            slot[b] = (int)bone.size();
+            bone.push_back(b);
+            parentSlot.push_back(skeleton.parent[b] < 0 ? -1 : slot[skeleton.parent[b]]);
+        }
+    }
+    for (size_t i = 0; i < targets.size(); i++) {
+        target.push_back(slot[targets[i]]);
+    }
+    std::vector<DofDecode> decoders;
+    std::vector<int> offsets;
+    std::vector<glm::quat> bind;
+    for (size_t s = 0; s < bone.size(); s++) {
+        decoders.push_back(skeleton.decoder[bone[s]]);
+        offsets.push_back(skeleton.channelOffset[bone[s]]);
+        bind.push_back(skeleton.bindRotation[bone[s]]);
+    }
+    kernel.setJoints((int)bone.size(), decoders.data(), offsets.data(), bind.data());
+    local.resize(bone.size());
+    world.resize(bone.size());
+    end.resize(bone.size());
+}
+
+inline void JointQuery::evaluate(const glm::mat4x3 &root, const float *frame, glm::vec3 *joints) {
+    kernel.decode(frame, local.data());
+    for (size_t s = 0; s < bone.size(); s++) {
+        int p = parentSlot[s];
+        forwardStep(p < 0 ? root : world[p], p < 0 ? root[3] : end[p], local[s],
+                    skeleton.boneVector[bone[s]], world[s], end[s]);
+    }
+    for (size_t i = 0; i < target.size(); i++) {
+        joints[i] = end[target[i]];
+    }
+}
+
+inline void JointQuery::evaluate(const glm::mat4x3 *roots, const float *frames, int frameCount,
+                                 int frameSize, glm::vec3 *joints) {
+    for (int f = 0; f < frameCount; f++) {
+        evaluate(roots[f], frames + (size_t)f*frameSize, joints + (size_t)f*target.size());
+    }
+}
+
+#endif
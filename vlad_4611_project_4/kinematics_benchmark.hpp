@@ -0,0 +1,343 @@
+#ifndef KINEMATICS_BENCHMARK_HPP
+#define KINEMATICS_BENCHMARK_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "character.hpp"
+#include "clip.hpp"
+#include "crowd_kinematics.hpp"
+#include "float_lanes.hpp"
+#include "joint_query.hpp"
+#include "pose.hpp"
+
+// Times how long it takes to turn frames of a clip into joint
+// rotations, comparing the batched kernel of euler_kernel.hpp with
+// building every rotation from glm::rotate calls; forward kinematics
+// through the unrolled CMU path against the loop over the bones; the
+// feet and head alone through a JointQuery against a whole Pose;
+// Pose::update() against Pose::evaluate() frame after frame; and
+// forward kinematics for a crowd of characters playing the clip,
+// comparing CrowdKinematics with posing them one at a time and with
+// walking the hierarchy recursively in 4x4 matrices. Checks that they
+// agree. Run with "--benchmark"; results go to stderr.
+class KinematicsBenchmark {
+public:
+    static void run(const std::string &asfFile, const std::string &amcFile);
+
+protected:
+    static void unrolled(const Skeleton &skeleton, const std::vector<glm::quat> &local, int frames);
+    static void partial(const Skeleton &skeleton, const std::vector<float> &values, int frames);
+    static void incremental(const Skeleton &skeleton, const std::vector<float> &values, int frames);
+    static void crowd(const Skeleton &skeleton, const std::vector<float> &values, int frames);
+    // Repeats pass (which goes over all frameCount frames) for a
+    // quarter of a second and returns nanoseconds per frame.
+    template <typename F> static double time(int frameCount, F pass);
+    // The rotation of bone b as it was built before the kernel: three
+    // rotations and an inverse, all 4x4.
+    static glm::mat4 glmRotation(const Skeleton &skeleton, int b, const float *frame);
+    // Bone ends the way drawing used to find them: recursively, each
+    // bone's matrix passed down to its children.
+    static void recursiveEnds(const Skeleton &skeleton, const std::vector<std::vector<int> > &children,
+                              int b, const glm::mat4 &start, const float *frame, glm::vec3 *end);
+};
+
+// Definitions below
+
+inline void KinematicsBenchmark::run(const std::string &asfFile, const std::string &amcFile) {
+    Character character(asfFile);
+    AnimationClip clip;
+    if (!character.hasSkeleton() || !clip.load(amcFile, character.channelLayout())) {
+        std::cerr << "Benchmark: could not load " << asfFile << " and " << amcFile << std::endl;
+        return;
+    }
+    const Skeleton &skeleton = character.getSkeleton();
+    int bones = skeleton.boneCount(), frames = clip.frameCount();
+    int frameSize = skeleton.getLayout().frameSize;
+    std::vector<float> values((size_t)frames*frameSize);
+    for (int f = 0; f < frames; f++) {
+        std::copy(clip.frame(f), clip.frame(f) + frameSize, &values[(size_t)f*frameSize]);
+    }
+    std::cerr << "Benchmark: " << bones << " bones, " << frames << " frames" << std::endl;
+
+    std::vector<glm::mat4> reference(bones);
+    std::vector<glm::quat> local(bones), all((size_t)frames*bones);
+    double glmNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            for (int b = 0; b < bones; b++) {
+                reference[b] = glmRotation(skeleton, b, &values[(size_t)f*frameSize]);
+            }
+        }
+    });
+    double scalarNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            for (int b = 0; b < bones; b++) {
+                local[b] = skeleton.localRotation(b, &values[(size_t)f*frameSize]);
+            }
+        }
+    });
+    double kernelNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            skeleton.localRotations(&values[(size_t)f*frameSize], local.data());
+        }
+    });
+    double batchNs = time(frames, [&]() {
+        skeleton.localRotations(values.data(), frames, all.data());
+    });
+
+    float maxError = 0;
+    for (int f = 0; f < frames; f++) {
+        for (int b = 0; b < bones; b++) {
+            glm::mat4 r = glmRotation(skeleton, b, &values[(size_t)f*frameSize]);
+            glm::mat3 q = glm::mat3_cast(all[(size_t)f*bones + b]);
+            for (int col = 0; col < 3; col++) {
+                for (int row = 0; row < 3; row++) {
+                    maxError = std::max(maxError, std::abs(r[col][row] - q[col][row]));
+                }
+            }
+        }
+    }
+    std::cerr << "  glm::rotate:            " << glmNs << " ns/frame" << std::endl
+              << "  closed form, per bone:  " << scalarNs << " ns/frame" << std::endl
+              << "  kernel, per frame:      " << kernelNs << " ns/frame" << std::endl
+              << "  kernel, whole clip:     " << batchNs << " ns/frame" << std::endl
+              << "  max difference from glm::rotate: " << maxError << std::endl;
+    unrolled(skeleton, all, frames);
+    partial(skeleton, values, frames);
+    incremental(skeleton, values, frames);
+    crowd(skeleton, values, frames);
+}
+
+inline void KinematicsBenchmark::unrolled(const Skeleton &skeleton, const std::vector<glm::quat> &local,
+                                          int frames) {
+    if (!skeleton.hasCmuTopology()) {
+        std::cerr << "Benchmark: not the CMU hierarchy, no unrolled FK" << std::endl;
+        return;
+    }
+    int bones = skeleton.boneCount();
+    glm::mat4x3 root(1.f);
+    std::vector<glm::mat4x3> world(bones);
+    std::vector<glm::vec3> loopEnd(bones), unrolledEnd(bones);
+    double loopNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            Pose::forward(skeleton, root, &local[(size_t)f*bones], world.data(), loopEnd.data());
+        }
+    });
+    double unrolledNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            CmuTopology::forward(root, &local[(size_t)f*bones], skeleton.boneVector.data(),
+                                 world.data(), unrolledEnd.data());
+        }
+    });
+    float maxError = 0;
+    for (int b = 0; b < bones; b++) {
+        glm::vec3 d = glm::abs(loopEnd[b] - unrolledEnd[b]);
+        maxError = std::max(maxError, std::max(d.x, std::max(d.y, d.z)));
+    }
+    std::cerr << "Benchmark: forward kinematics from local rotations" << std::endl
+              << "  loop over the bones:    " << loopNs << " ns/frame" << std::endl
+              << "  unrolled CMU hierarchy: " << unrolledNs << " ns/frame" << std::endl
+              << "  max joint difference: " << maxError << " m" << std::endl;
+}
+
+inline void KinematicsBenchmark::partial(const Skeleton &skeleton, const std::vector<float> &values,
+                                         int frames) {
+    std::vector<int> targets;
+    const char *names[] = {"ltoes", "rtoes", "head"};
+    for (int i = 0; i < 3; i++) {
+        if (skeleton.findBone(names[i]) >= 0) {
+            targets.push_back(skeleton.findBone(names[i]));
+        }
+    }
+    if (targets.empty()) {
+        std::cerr << "Benchmark: no feet or head, no partial FK" << std::endl;
+        return;
+    }
+    int frameSize = skeleton.getLayout().frameSize;
+    glm::mat4x3 root(1.f);
+    Pose pose;
+    JointQuery query(skeleton, targets);
+    std::vector<glm::vec3> joints(targets.size());
+    double poseNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            pose.evaluate(skeleton, root, &values[(size_t)f*frameSize]);
+        }
+    });
+    double queryNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            query.evaluate(root, &values[(size_t)f*frameSize], joints.data());
+        }
+    });
+    float maxError = 0;
+    for (int f = 0; f < frames; f++) {
+        pose.evaluate(skeleton, root, &values[(size_t)f*frameSize]);
+        query.evaluate(root, &values[(size_t)f*frameSize], joints.data());
+        for (size_t i = 0; i < targets.size(); i++) {
+            glm::vec3 d = glm::abs(pose.end[targets[i]] - joints[i]);
+            maxError = std::max(maxError, std::max(d.x, std::max(d.y, d.z)));
+        }
+    }
+    std::cerr << "Benchmark: " << targets.size() << " joints (feet, head) of " << skeleton.boneCount()
+              << " bones" << std::endl
+              << "  whole Pose:             " << poseNs << " ns/frame" << std::endl
+              << "  JointQuery, " << query.chainLength() << " bones:  " << queryNs << " ns/frame"
+              << std::endl
+              << "  max joint difference: " << maxError << " m" << std::endl;
+}
+
+inline void KinematicsBenchmark::incremental(const Skeleton &skeleton, const std::vector<float> &values,
+                                             int frames) {
+    int bones = skeleton.boneCount(), frameSize = skeleton.getLayout().frameSize;
+    glm::mat4x3 root(1.f);
+    Pose full, incremental;
+    double fullNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            full.evaluate(skeleton, root, &values[(size_t)f*frameSize]);
+        }
+    });
+    std::cerr << "Benchmark: playing the clip through Pose::update()" << std::endl
+              << "  Pose::evaluate():       " << fullNs << " ns/frame" << std::endl;
+    // Exact, then within a hundredth of a degree.
+    const float epsilons[] = {0.f, 0.01f};
+    for (int e = 0; e < 2; e++) {
+        float epsilon = epsilons[e];
+        double updateNs = time(frames, [&]() {
+            for (int f = 0; f < frames; f++) {
+                incremental.update(skeleton, root, &values[(size_t)f*frameSize], epsilon);
+            }
+        });
+        long rotations = 0, joints = 0;
+        float maxError = 0;
+        for (int f = 0; f < frames; f++) {
+            full.evaluate(skeleton, root, &values[(size_t)f*frameSize]);
+            incremental.update(skeleton, root, &values[(size_t)f*frameSize], epsilon);
+            rotations += incremental.lastUpdate.rotations;
+            joints += incremental.lastUpdate.joints;
+            for (int b = 0; b < bones; b++) {
+                glm::vec3 d = glm::abs(full.end[b] - incremental.end[b]);
+                maxError = std::max(maxError, std::max(d.x, std::max(d.y, d.z)));
+            }
+        }
+        std::cerr << "  update(), epsilon " << epsilon << ": " << updateNs << " ns/frame, "
+                  << (double)rotations/frames << " rotations and " << (double)joints/frames
+                  << " joints of " << bones << " per frame, max joint difference " << maxError
+                  << " m" << std::endl;
+    }
+    // Every frame shown twice, as when playing at half speed; the
+    // second update() has nothing to do.
+    double heldNs = time(frames, [&]() {
+        for (int f = 0; f < frames; f++) {
+            incremental.update(skeleton, root, &values[(size_t)f*frameSize]);
+            incremental.update(skeleton, root, &values[(size_t)f*frameSize]);
+        }
+    });
+    std::cerr << "  update(), frames held twice: " << heldNs/2 << " ns/update, against "
+              << fullNs << " for evaluate()" << std::endl;
+}
+
+inline void KinematicsBenchmark::crowd(const Skeleton &skeleton, const std::vector<float> &values,
+                                       int frames) {
+    // Everyone plays the clip from a different frame, in a different
+    // place.
+    const int characters = 256;
+    int bones = skeleton.boneCount(), frameSize = skeleton.getLayout().frameSize;
+    std::vector<const float *> frame(characters);
+    std::vector<glm::mat4x3> roots(characters);
+    for (int i = 0; i < characters; i++) {
+        frame[i] = &values[(size_t)(i*37 % frames)*frameSize];
+        glm::mat3 rotation = rotationZYX(frame[i][5], frame[i][4], frame[i][3]);
+        roots[i] = glm::mat4x3(rotation[0], rotation[1], rotation[2], glm::vec3(i % 16, 0, i / 16));
+    }
+    std::vector<std::vector<int> > children(bones + 1);
+    for (int b = 0; b < bones; b++) {
+        children[skeleton.parent[b] + 1].push_back(b);
+    }
+    std::vector<glm::vec3> ends(bones);
+    std::vector<Pose> single(characters), batched(characters);
+    CrowdKinematics kinematics;
+
+    double recursiveNs = time(characters, [&]() {
+        for (int i = 0; i < characters; i++) {
+            for (size_t k = 0; k < children[0].size(); k++) {
+                recursiveEnds(skeleton, children, children[0][k], glm::mat4(roots[i]), frame[i], ends.data());
+            }
+        }
+    });
+    double singleNs = time(characters, [&]() {
+        for (int i = 0; i < characters; i++) {
+            single[i].evaluate(skeleton, roots[i], frame[i]);
+        }
+    });
+    double scalarNs = time(characters, [&]() {
+        kinematics.evaluate<ScalarLanes>(skeleton, characters, roots.data(), frame.data(), batched.data());
+    });
+    double simdNs = time(characters, [&]() {
+        kinematics.evaluate(skeleton, characters, roots.data(), frame.data(), batched.data());
+    });
+
+    float maxError = 0;
+    for (int i = 0; i < characters; i++) {
+        for (int b = 0; b < bones; b++) {
+            glm::vec3 d = glm::abs(single[i].end[b] - batched[i].end[b]);
+            maxError = std::max(maxError, std::max(d.x, std::max(d.y, d.z)));
+        }
+    }
+    std::cerr << "Benchmark: crowd of " << characters << " characters" << std::endl
+              << "  recursive, glm::rotate:  " << recursiveNs << " ns/character" << std::endl
+              << "  Pose, one at a time:     " << singleNs << " ns/character" << std::endl
+              << "  CrowdKinematics, 1 lane: " << scalarNs << " ns/character" << std::endl
+              << "  CrowdKinematics, " << FloatLanes::WIDTH
+              << (FloatLanes::WIDTH == 1 ? " lane: " : " lanes: ") << simdNs
+              << " ns/character" << std::endl
+              << "  max joint difference from Pose: " << maxError << " m" << std::endl;
+}
+
+template <typename F>
+inline double KinematicsBenchmark::time(int frameCount, F pass) {
+    using namespace std::chrono;
+    const double minSeconds = 0.25;
+    long long done = 0;
+    steady_clock::time_point begin = steady_clock::now();
+    double seconds = 0;
+    while (frameCount > 0 && seconds < minSeconds) {
+        pass();
+        done += frameCount;
+        seconds = duration<double>(steady_clock::now() - begin).count();
+    }
+    return done ? seconds*1e9/done : 0;
+}
+
+inline glm::mat4 KinematicsBenchmark::glmRotation(const Skeleton &skeleton, int b, const float *frame) {
+    const float *v = frame + skeleton.channelOffset[b];
+    float angle[3] = {0, 0, 0};
+    for (int axis = 0; axis < 3; axis++) {
+        if (skeleton.dofMask[b] & (1 << axis)) {
+            angle[axis] = *v++;
+        }
+    }
+    glm::mat4 bind = glm::mat4_cast(skeleton.bindRotation[b]), r;
+    r = glm::rotate(r, glm::radians(angle[2]), glm::vec3(0,0,1));
+    r = glm::rotate(r, glm::radians(angle[1]), glm::vec3(0,1,0));
+    r = glm::rotate(r, glm::radians(angle[0]), glm::vec3(1,0,0));
+    return bind * r * glm::inverse(bind);
+}
+
+inline void KinematicsBenchmark::recursiveEnds(const Skeleton &skeleton,
+                                               const std::vector<std::vector<int> > &children,
+                                               int b, const glm::mat4 &start, const float *frame,
+                                               glm::vec3 *end) {
+    glm::mat4 world = start * glmRotation(skeleton, b, frame);
+    glm::mat4 next = glm::translate(world, skeleton.boneVector[b]);
+    end[b] = glm::vec3(next[3]);
+    const std::vector<int> &below = children[b + 1];
+    for (size_t k = 0; k < below.size(); k++) {
+        recursiveEnds(skeleton, children, below[k], next, frame, end);
+    }
+}
+
+#endif
@@ -0,0 +1,371 @@
+#ifndef LIVE_CLIP_HPP
+#define LIVE_CLIP_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "clip.hpp"
+#include "frame_source.hpp"
+#include "mapped_reader.hpp"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Follows an AMC file that is still being written, such as the output
+// of the capture system's solver. Each call to poll() reads only the
+// bytes appended since the previous call and decodes the frames that
+// are now complete; nothing before that point is read twice.
+//
+// On Linux, inotify tells us when the file changes; elsewhere, or if
+// inotify is unavailable, poll() compares the file size instead.
+//
+// Every frame remembers when poll() read it from the file, so the delay
+// until it is drawn can be measured. The time the frame spent in the
+// file before that is not known (file times are too coarse on some
+// systems and only tell when the newest bytes arrived), so the figures
+// are a lower bound on write-to-draw latency; with inotify the gap is
+// at most one call to poll(). Frames already in the file when it is
+// opened are not included in those statistics.
+//
+// A frame that does not list the bones of the first one, or has the
+// wrong number of values on a line, is dropped with a message rather
+// than stopping the program the way a bad file does when preloaded.
+class LiveClip : public FrameSource {
+public:
+    struct Stats {
+        int framesReceived;  // since open()
+        int framesDrawn;     // distinct new frames drawn
+        int framesDropped;   // malformed frames skipped
+        double lastLatency;  // seconds from being read to being drawn
+        double meanLatency;
+        double maxLatency;
+    };
+
+    LiveClip();
+    ~LiveClip();
+
+    // Reads whatever the file holds so far. Returns false if it
+    // cannot be opened; an empty file is fine.
+    bool open(std::string amcFilename, const ChannelLayout &layout);
+
+    // Picks up newly appended frames. Returns how many were added.
+    int poll();
+
+    int frameCount() const { return numFrames; }
+    const ChannelLayout &getLayout() const { return layout; }
+    const float *frame(int f) const { return &data[(size_t)f*layout.frameSize]; }
+    // Frames are in memory, but only the owner polls for new ones and
+    // reports the frames it draws.
+    bool randomAccess() const { return false; }
+
+    // Playback stays this far (in seconds of mocap) behind the newest
+    // frame. A small delay absorbs uneven delivery from the writer;
+    // 0 always shows the newest frame.
+    void setLatencyTarget(float seconds) { latencyTarget = seconds; }
+    int playbackFrame() const;
+
+    // Called when frame f is drawn, to measure read-to-draw latency.
+    // Prints a summary to stderr every few seconds.
+    void frameDrawn(int f);
+    Stats getStats() const { return stats; }
+    bool usingInotify() const { return inotifyFd >= 0; }
+
+protected:
+    static double wallClock();
+    bool changed();
+    bool readNewBytes();
+    int parsePending(double readTime);
+    bool frameFits(const char *begin, const char *end) const;
+    void reset();
+    std::string filename;
+    ChannelLayout layout;
+    ChannelSchema schema;
+    std::vector<float> data;
+    std::vector<double> readTimes;  // per frame, < 0 if unknown
+    int numFrames;
+    std::ifstream in;
+    unsigned long long fileOffset;  // bytes read so far
+    std::vector<char> pending;      // read but not yet a complete frame
+    int inotifyFd, watch;
+    float latencyTarget;
+    int lastDrawn;
+    double latencySum, lastReport;
+    Stats stats;
+};
+
+// Definitions below
+
+inline LiveClip::LiveClip() {
+    numFrames = 0;
+    fileOffset = 0;
+    inotifyFd = -1;
+    watch = -1;
+    latencyTarget = 0;
+    lastDrawn = -1;
+    latencySum = 0;
+    lastReport = 0;
+    std::memset(&stats, 0, sizeof(stats));
+}
+
+inline LiveClip::~LiveClip() {
+#ifdef __linux__
+    if (inotifyFd >= 0) {
+        close(inotifyFd);
+    }
+#endif
+}
+
+inline double LiveClip::wallClock() {
+    using namespace std::chrono;
+    return duration<double>(system_clock::now().time_since_epoch()).count();
+}
+
+inline bool LiveClip::open(std::string amcFilename, const ChannelLayout &layout) {
+    filename = amcFilename;
+    this->layout = layout;
+    reset();
+    in.close();
+    in.clear();
+    in.open(filename.c_str(), std::ios::binary);
+    if (!in) {
+        return false;
+    }
+#ifdef __linux__
+    if (inotifyFd < 0) {
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd >= 0) {
+            watch = inotify_add_watch(inotifyFd, filename.c_str(),
+                                      IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+            if (watch < 0) {
+                close(inotifyFd);
+                inotifyFd = -1;
+            }
+        }
+    }
+#endif
+    if (readNewBytes()) {
+        parsePending(-1); // existing frames don't count towards latency
+    }
+    stats.framesReceived = 0;
+    stats.framesDropped = 0;
+    return true;
+}
+
+inline void LiveClip::reset() {
+    schema = ChannelSchema();
+    data.clear();
+    readTimes.clear();
+    numFrames = 0;
+    fileOffset = 0;
+    pending.clear();
+    lastDrawn = -1;
+}
+
+// Returns true if the file may have grown since the last read.
+inline bool LiveClip::changed() {
+#ifdef __linux__
+    if (inotifyFd >= 0) {
+        char events[4096];
+        bool any = false;
+        ssize_t n;
+        while ((n = read(inotifyFd, events, sizeof(events))) > 0) {
+            for (char *p = events; p < events + n; ) {
+                inotify_event *e = (inotify_event*)p;
+                if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    // The watched file went away; a new one with the
+                    // same name is picked up by polling its size.
+                    close(inotifyFd);
+                    inotifyFd = -1;
+                    return true;
+                }
+                p += sizeof(inotify_event) + e->len;
+            }
+            any = true;
+        }
+        return any;
+    }
+#endif
+    return true; // polling: readNewBytes checks the size
+}
+
+inline bool LiveClip::readNewBytes() {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+    unsigned long long size = (unsigned long long)st.st_size;
+    if (size < fileOffset) {
+        // The file was truncated or replaced: start over.
+        std::cerr << "Live clip " << filename << " shrank, reloading" << std::endl;
+        reset();
+        in.close();
+        in.clear();
+        in.open(filename.c_str(), std::ios::binary);
+    }
+    if (size == fileOffset) {
+        return false;
+    }
+    size_t oldSize = pending.size();
+    pending.resize(oldSize + (size_t)(size - fileOffset));
+    in.clear();
+    in.seekg((std::streamoff)fileOffset);
+    in.read(&pending[oldSize], (std::streamsize)(size - fileOffset));
+    size_t got = (size_t)in.gcount();
+    pending.resize(oldSize + got);
+    fileOffset += got;
+    return got > 0;
+}
+
+inline int LiveClip::poll() {
+    if (!changed()) {
+        return 0;
+    }
+    if (!readNewBytes()) {
+        return 0;
+    }
+    return parsePending(wallClock());
+}
+
+inline int LiveClip::parsePending(double readTime) {
+    // Frames start at lines beginning with a digit. A frame is complete
+    // once the next one has started, or, once the schema is known, when
+    // all of its bone lines have been terminated.
+    const char *begin = pending.data(), *end = begin + pending.size();
+    std::vector<const char*> starts;
+    for (const char *p = begin; p < end; ) {
+        if (*p >= '0' && *p <= '9') {
+            starts.push_back(p);
+        }
+        const char *nl = (const char*)std::memchr(p, '\n', end - p);
+        if (!nl) {
+            break;
+        }
+        p = nl + 1;
+    }
+    const char *consumed = begin;
+    if (starts.empty()) {
+        // Only header lines so far; drop the ones that are complete.
+        for (const char *p = begin; p < end; p++) {
+            if (*p == '\n') {
+                consumed = p + 1;
+            }
+        }
+    }
+    int added = 0;
+    for (int i = 0; i < starts.size(); i++) {
+        const char *frameEnd = (i + 1 < starts.size()) ? starts[i+1] : NULL;
+        if (!frameEnd) {
+            long lines = std::count(starts[i], end, '\n');
+            if (schema.empty() || lines < (long)schema.entries.size() + 1) {
+                consumed = starts[i];
+                break;
+            }
+            frameEnd = end;
+        }
+        consumed = frameEnd;
+        if (!frameFits(starts[i], frameEnd)) {
+            std::cerr << "Live clip " << filename << ": dropping malformed frame "
+                      << std::atoi(starts[i]) << std::endl;
+            stats.framesDropped++;
+            continue;
+        }
+        MappedReader r(starts[i], frameEnd);
+        if (AnimationClip::parseFrames(r, layout, schema, data, 1) == 1) {
+            numFrames++;
+            readTimes.push_back(readTime);
+            added++;
+        }
+    }
+    pending.erase(pending.begin(), pending.begin() + (consumed - begin));
+    stats.framesReceived += added;
+    return added;
+}
+
+// Checks what parseFrames() would abort on: every line after the frame
+// number names a bone, in the order of the schema once there is one,
+// and carries as many numbers as the bone has channels.
+inline bool LiveClip::frameFits(const char *begin, const char *end) const {
+    std::istringstream text(std::string(begin, end));
+    std::string line, name;
+    std::getline(text, line); // the frame number
+    std::vector<std::string> names;
+    while (std::getline(text, line)) {
+        std::istringstream fields(line);
+        if (!(fields >> name)) {
+            continue;
+        }
+        int values = 0;
+        float value;
+        while (fields >> value) {
+            values++;
+        }
+        if (!fields.eof()
+            || std::find(names.begin(), names.end(), name) != names.end()) {
+            return false;
+        }
+        int dofs;
+        if (!schema.empty()) {
+            if (names.size() >= schema.entries.size()
+                || name != schema.entries[names.size()].name) {
+                return false;
+            }
+            dofs = schema.entries[names.size()].dofs;
+        } else if (name == "root") {
+            dofs = ChannelLayout::rootChannels;
+        } else {
+            int b = layout.boneIndex(name);
+            if (b < 0) {
+                return false;
+            }
+            dofs = layout.dofs[b];
+        }
+        if (values != dofs) {
+            return false;
+        }
+        names.push_back(name);
+    }
+    return !names.empty() && (schema.empty() || names.size() == schema.entries.size());
+}
+
+inline int LiveClip::playbackFrame() const {
+    float fps = 120;
+    int behind = (int)std::ceil(latencyTarget*fps);
+    return std::max(0, numFrames - 1 - behind);
+}
+
+inline void LiveClip::frameDrawn(int f) {
+    if (f == lastDrawn || f < 0 || f >= numFrames) {
+        return;
+    }
+    lastDrawn = f;
+    double now = wallClock();
+    if (readTimes[f] >= 0) {
+        double latency = now - readTimes[f];
+        stats.framesDrawn++;
+        stats.lastLatency = latency;
+        stats.maxLatency = std::max(stats.maxLatency, latency);
+        latencySum += latency;
+        stats.meanLatency = latencySum / stats.framesDrawn;
+    }
+    if (now - lastReport > 5 && stats.framesDrawn > 0) {
+        std::cerr << "Live clip: " << stats.framesReceived << " frames received, "
+                  << stats.framesDropped << " dropped, "
+                  << "read-to-draw latency last " << stats.lastLatency*1000
+                  << " ms, mean " << stats.meanLatency*1000
+                  << " ms, max " << stats.maxLatency*1000 << " ms"
+                  << (usingInotify() ? "" : " (polling)") << std::endl;
+        lastReport = now;
+    }
+}
+
+#endif
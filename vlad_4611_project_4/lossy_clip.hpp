@@ -0,0 +1,334 @@
+#ifndef LOSSY_CLIP_HPP
+#define LOSSY_CLIP_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include <glm/glm.hpp>
+#include "clip.hpp"
+#include "clip_codec.hpp"
+#include "frame_source.hpp"
+
+// A clip compressed for playback with bounded error, for scenes with
+// many characters where memory matters more than exact values.
+//
+// Every channel is quantized to the fewest bits that keep its error
+// small over its range (the bone's RotationBounds, widened to whatever
+// the clip actually reaches), and only key frames are stored: the
+// frames in between are linearly interpolated from the keys around
+// them.
+//
+// The tolerance is the distance in meters by which any joint may move
+// from where the original clip puts it. It is checked on every frame
+// through the real forward kinematics (supplied by the caller), so
+// errors that add up along a chain such as lfemur -> ltoes are
+// included. Half of it goes to quantization and the rest to dropping
+// frames.
+class LossyClip : public FrameSource {
+public:
+    // Computes the world positions of all joints for one frame of
+    // channel values, always in the same order.
+    typedef std::function<void(const float *frame, std::vector<glm::vec3> &joints)> Kinematics;
+
+    struct Report {
+        int frames;
+        int keyFrames;
+        int bitsPerKey;
+        size_t rawBytes;         // frameCount*frameSize floats
+        size_t compressedBytes;
+        float ratio;
+        float maxError;          // meters, measured on every frame
+    };
+
+    LossyClip();
+
+    // Compresses clip. minValues and maxValues give the expected range
+    // of each channel (empty ranges are allowed; they grow to cover the
+    // data). Returns false if the tolerance could not be met (even 24
+    // bits per channel were too coarse); the clip is still compressed
+    // and getReport() has the error it reached.
+    bool compress(const FrameSource &clip, std::vector<float> minValues,
+                  std::vector<float> maxValues, float tolerance, Kinematics kinematics);
+
+    int frameCount() const { return numFrames; }
+    const ChannelLayout &getLayout() const { return layout; }
+    const float *frame(int f) const;
+    Report getReport() const { return report; }
+
+protected:
+    struct Channel {
+        float low, step;  // value = low + q*step
+        int bits;         // 0 for a constant channel
+    };
+    bool chooseSteps(const FrameSource &clip, float tolerance, Kinematics &kinematics);
+    void quantize(const float *values, std::vector<uint32_t> &q) const;
+    void dequantize(const uint32_t *q, float *values) const;
+    void decodeKey(int k, float *values) const;
+    static void interpolate(const float *a, const float *b, float t, int n, float *out);
+    static float maxDistance(const std::vector<glm::vec3> &a, const std::vector<glm::vec3> &b);
+
+    ChannelLayout layout;
+    int numFrames, frameSize;
+    std::vector<Channel> channels;
+    int bitsPerKey;
+    std::vector<int> keys;     // frame numbers of the key frames
+    std::vector<char> packed;  // key frames, bitsPerKey bits each
+    Report report;
+    mutable std::vector<float> values, keyA, keyB;
+    mutable int currentFrame;
+};
+
+// Definitions below
+
+inline LossyClip::LossyClip() {
+    numFrames = 0;
+    frameSize = 0;
+    bitsPerKey = 0;
+    currentFrame = -1;
+    std::memset(&report, 0, sizeof(report));
+}
+
+inline void LossyClip::quantize(const float *values, std::vector<uint32_t> &q) const {
+    q.resize(frameSize);
+    for (int c = 0; c < frameSize; c++) {
+        const Channel &ch = channels[c];
+        if (ch.bits == 0) {
+            q[c] = 0;
+            continue;
+        }
+        float level = std::floor((values[c] - ch.low)/ch.step + 0.5f);
+        float top = (float)((1u << ch.bits) - 1);
+        q[c] = (uint32_t)std::max(0.f, std::min(level, top));
+    }
+}
+
+inline void LossyClip::dequantize(const uint32_t *q, float *values) const {
+    for (int c = 0; c < frameSize; c++) {
+        values[c] = channels[c].low + q[c]*channels[c].step;
+    }
+}
+
+inline void LossyClip::interpolate(const float *a, const float *b, float t, int n, float *out) {
+    for (int c = 0; c < n; c++) {
+        out[c] = a[c] + (b[c] - a[c])*t;
+    }
+}
+
+inline float LossyClip::maxDistance(const std::vector<glm::vec3> &a,
+                                    const std::vector<glm::vec3> &b) {
+    float d = 0;
+    for (size_t j = 0; j < a.size(); j++) {
+        d = std::max(d, glm::length(a[j] - b[j]));
+    }
+    return d;
+}
+
+// Picks the quantization step of every channel. A channel's step is
+// set from how far the joints move per unit of that channel (found by
+// nudging it through the kinematics), then all steps shrink together
+// until no frame is off by more than tolerance. Returns false if they
+// could not get there within 24 bits or 16 tries.
+inline bool LossyClip::chooseSteps(const FrameSource &clip, float tolerance,
+                                   Kinematics &kinematics) {
+    std::vector<float> lever(frameSize, 0.f);
+    std::vector<float> nudged(frameSize);
+    std::vector<glm::vec3> base, moved;
+    const float delta = 0.01f;
+    int sampleEvery = std::max(1, numFrames/32);
+    for (int f = 0; f < numFrames; f += sampleEvery) {
+        const float *v = clip.frame(f);
+        kinematics(v, base);
+        for (int c = 0; c < frameSize; c++) {
+            if (channels[c].bits == 0) {
+                continue;
+            }
+            std::copy(v, v + frameSize, nudged.begin());
+            nudged[c] += delta;
+            kinematics(nudged.data(), moved);
+            lever[c] = std::max(lever[c], maxDistance(base, moved)/delta);
+        }
+    }
+    int active = 0;
+    for (int c = 0; c < frameSize; c++) {
+        active += channels[c].bits != 0;
+    }
+    // Rounding errors mostly cancel, so start from the statistical
+    // estimate and tighten if the measurement says otherwise.
+    float perChannel = tolerance/std::sqrt((float)std::max(active, 1));
+    std::vector<float> ranges(frameSize);
+    for (int c = 0; c < frameSize; c++) {
+        ranges[c] = channels[c].bits ? channels[c].step : 0; // see compress()
+    }
+    std::vector<uint32_t> q;
+    std::vector<float> decoded(frameSize);
+    for (int attempt = 0; attempt < 16; attempt++) {
+        for (int c = 0; c < frameSize; c++) {
+            Channel &ch = channels[c];
+            float range = ranges[c];
+            if (range <= 0 || lever[c] <= 0) {
+                ch.bits = range > 0 ? 1 : 0;
+                ch.step = range > 0 ? range : 1;
+                continue;
+            }
+            float step = 2*perChannel/lever[c];
+            int bits = 1;
+            while (bits < 24 && (float)((1u << bits) - 1)*step < range) {
+                bits++;
+            }
+            ch.bits = bits;
+            ch.step = range/(float)((1u << bits) - 1);
+        }
+        float worst = 0;
+        for (int f = 0; f < numFrames; f++) {
+            const float *v = clip.frame(f);
+            quantize(v, q);
+            dequantize(q.data(), decoded.data());
+            kinematics(v, base);
+            kinematics(decoded.data(), moved);
+            worst = std::max(worst, maxDistance(base, moved));
+        }
+        if (worst <= tolerance) {
+            return true;
+        }
+        perChannel *= 0.7f;
+    }
+    return false;
+}
+
+inline bool LossyClip::compress(const FrameSource &clip, std::vector<float> minValues,
+                                std::vector<float> maxValues, float tolerance,
+                                Kinematics kinematics) {
+    layout = clip.getLayout();
+    numFrames = clip.frameCount();
+    frameSize = layout.frameSize;
+    currentFrame = -1;
+    keys.clear();
+    packed.clear();
+    minValues.resize(frameSize, 0.f);
+    maxValues.resize(frameSize, 0.f);
+    // Mocap often strays a little outside the ASF limits, so the range
+    // of each channel also covers every value in the clip.
+    for (int f = 0; f < numFrames; f++) {
+        const float *v = clip.frame(f);
+        for (int c = 0; c < frameSize; c++) {
+            minValues[c] = std::min(minValues[c], v[c]);
+            maxValues[c] = std::max(maxValues[c], v[c]);
+        }
+    }
+    channels.assign(frameSize, Channel());
+    for (int c = 0; c < frameSize; c++) {
+        channels[c].low = minValues[c];
+        channels[c].step = maxValues[c] - minValues[c];
+        channels[c].bits = maxValues[c] > minValues[c] ? 1 : 0;
+    }
+    report = Report();
+    if (numFrames == 0) {
+        return true;
+    }
+    if (!chooseSteps(clip, tolerance/2, kinematics)) {
+        std::cerr << "LossyClip: quantization alone exceeds " << tolerance/2*1000
+                  << " mm at the finest steps" << std::endl;
+    }
+    bitsPerKey = 0;
+    for (int c = 0; c < frameSize; c++) {
+        bitsPerKey += channels[c].bits;
+    }
+
+    // Quantize every frame once; keys are chosen among these.
+    std::vector<float> decoded((size_t)numFrames*frameSize);
+    std::vector<std::vector<glm::vec3> > original(numFrames);
+    std::vector<uint32_t> q;
+    for (int f = 0; f < numFrames; f++) {
+        const float *v = clip.frame(f);
+        quantize(v, q);
+        dequantize(q.data(), &decoded[(size_t)f*frameSize]);
+        kinematics(v, original[f]);
+    }
+
+    // Greedily stretch each span between keys for as long as every
+    // frame inside it stays within tolerance.
+    const int maxSpan = 120;
+    std::vector<float> between(frameSize);
+    std::vector<glm::vec3> joints;
+    float maxError = 0;
+    int key = 0;
+    keys.push_back(0);
+    while (key < numFrames - 1) {
+        int next = key + 1;
+        for (int candidate = key + 2; candidate < numFrames && candidate - key <= maxSpan; candidate++) {
+            bool fits = true;
+            for (int f = key + 1; f < candidate && fits; f++) {
+                interpolate(&decoded[(size_t)key*frameSize], &decoded[(size_t)candidate*frameSize],
+                            (float)(f - key)/(candidate - key), frameSize, between.data());
+                kinematics(between.data(), joints);
+                fits = maxDistance(original[f], joints) <= tolerance;
+            }
+            if (!fits) {
+                break;
+            }
+            next = candidate;
+        }
+        keys.push_back(next);
+        key = next;
+    }
+
+    ClipCodec::BitWriter w(packed);
+    for (size_t k = 0; k < keys.size(); k++) {
+        quantize(clip.frame(keys[k]), q);
+        for (int c = 0; c < frameSize; c++) {
+            w.put(q[c], channels[c].bits);
+        }
+    }
+    w.flush();
+
+    // Measure what playback will actually show.
+    for (int f = 0; f < numFrames; f++) {
+        currentFrame = -1;
+        kinematics(frame(f), joints);
+        maxError = std::max(maxError, maxDistance(original[f], joints));
+    }
+    report.frames = numFrames;
+    report.keyFrames = (int)keys.size();
+    report.bitsPerKey = bitsPerKey;
+    report.rawBytes = (size_t)numFrames*frameSize*sizeof(float);
+    report.compressedBytes = packed.size() + keys.size()*sizeof(int)
+        + channels.size()*sizeof(Channel);
+    report.ratio = (float)report.rawBytes/report.compressedBytes;
+    report.maxError = maxError;
+    return maxError <= tolerance;
+}
+
+inline void LossyClip::decodeKey(int k, float *values) const {
+    uint64_t bit = (uint64_t)k*bitsPerKey;
+    ClipCodec::BitReader r(packed.data() + bit/8, packed.data() + packed.size());
+    r.get((int)(bit % 8));
+    for (int c = 0; c < frameSize; c++) {
+        uint32_t q = (uint32_t)r.get(channels[c].bits);
+        values[c] = channels[c].low + q*channels[c].step;
+    }
+}
+
+inline const float *LossyClip::frame(int f) const {
+    if (f == currentFrame) {
+        return values.data();
+    }
+    values.resize(frameSize);
+    keyA.resize(frameSize);
+    keyB.resize(frameSize);
+    int k = (int)(std::upper_bound(keys.begin(), keys.end(), f) - keys.begin()) - 1;
+    decodeKey(k, keyA.data());
+    if (keys[k] == f) {
+        values = keyA;
+    } else {
+        decodeKey(k + 1, keyB.data());
+        interpolate(keyA.data(), keyB.data(), (float)(f - keys[k])/(keys[k+1] - keys[k]),
+                    frameSize, values.data());
+    }
+    currentFrame = f;
+    return values.data();
+}
+
+#endif
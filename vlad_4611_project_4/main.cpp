@@ -1,11 +1,14 @@
 #include "engine.hpp"
 #include "camera.hpp"
 #include "character.hpp"
+#include "character_loader.hpp"
 #include "config.hpp"
 #include "draw.hpp"
+#include "kinematics_benchmark.hpp"
 #include "spline.hpp"
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
+#include <chrono>
 #include <iomanip>
 using namespace std;
 using glm::vec3;
@@ -16,23 +19,22 @@ public:
 	SDL_Window *window;
     OrbitCamera *camera;
 
-    Character *character;
+    CharacterLoader *loader;
+    Character *character; // NULL until the loader is done
     Spline3 *path;
     float time; // time along the path
-
-    SplineWalker() {
+    // For the startup log: when the process started and whether the
+    // first frame, and the first with the character in it, were drawn.
+    chrono::steady_clock::time_point startTime;
+    bool drewFrame, drewCharacter;
+
+    SplineWalker(CharacterLoader *loader, chrono::steady_clock::time_point startTime) {
+        this->loader = loader;
+        this->startTime = startTime;
+        drewFrame = drewCharacter = false;
         window = createWindow("Walk the Spline", 640, 360);
         camera = new OrbitCamera(5, 0, 0, Perspective(30, 16/9., 0.1, 20));
-        character = new Character(Config::asfFile, Config::amcFile,
-                                  Config::basePosition, Config::baseVelocity);
-        if (!character->hasSkeleton()) {
-            errorMessage("Failed to load file " + Config::asfFile);
-            exit(EXIT_FAILURE);
-        }
-        if (!character->hasAnimation()) {
-            errorMessage("Failed to load file " + Config::amcFile);
-            exit(EXIT_FAILURE);
-        }
+        character = NULL;
         path = new Spline3;
 
 
@@ -78,7 +80,25 @@ public:
         }
     }
 
+    // Picks the character up once the loader is done with it.
+    void checkLoader() {
+        if (character || !loader->finished()) {
+            return;
+        }
+        character = loader->getCharacter();
+        if (!character) {
+            errorMessage(loader->getError());
+            exit(EXIT_FAILURE);
+        }
+        cerr << "Startup: character loaded in " << loader->loadSeconds()*1000 << " ms" << endl;
+    }
+
+    double secondsSinceStart() {
+        return chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    }
+
     void advanceState(float dt) {
+        checkLoader();
         time += dt;
         if (time > path->maxTime())
             time = path->minTime();
@@ -88,7 +108,9 @@ public:
 
 
 		
-		if (bool enableSpeedAdjustment = true) {
+		if (!character) {
+			// still loading
+		} else if (bool enableSpeedAdjustment = true) {
 			float baseSpeed		= glm::length(Config::baseVelocity);
 			float currentSpeed	= glm::length(path->getDerivative(time)); //length of this derivative is speed.
 			character->advance(dt * (currentSpeed / baseSpeed)*.25);
@@ -162,10 +184,12 @@ public:
 			float rotAxisLength = glm::length(rotAxis);
 			float angleRad = glm::dot(b, z);
 			float angleDeg = (angleRad) * 90;
-			glPushMatrix();
-				glRotatef(-90 + angleDeg, rotAxis.x, rotAxis.y, rotAxis.z);
-				character->draw();
-			glPopMatrix();
+			if (character) {
+				glPushMatrix();
+					glRotatef(-90 + angleDeg, rotAxis.x, rotAxis.y, rotAxis.z);
+					character->draw();
+				glPopMatrix();
+			}
 
 			//line to future position marked by sphere
 			Draw::line(futurePosition - position);
@@ -182,6 +206,15 @@ public:
 
 
         SDL_GL_SwapWindow(window);
+        if (!drewFrame) {
+            drewFrame = true;
+            cerr << "Startup: first frame after " << secondsSinceStart()*1000 << " ms" << endl;
+        }
+        if (character && !drewCharacter) {
+            drewCharacter = true;
+            cerr << "Startup: first animated frame after " << secondsSinceStart()*1000
+                 << " ms" << endl;
+        }
     }
 
     void drawSpline(Spline3 *spline) {
@@ -231,7 +264,16 @@ public:
 };
 
 int main(int argc, char **argv) {
-    SplineWalker app;
+    if (argc > 1 && string(argv[1]) == "--benchmark") {
+        KinematicsBenchmark::run(Config::asfFile, Config::amcFile);
+        return EXIT_SUCCESS;
+    }
+    chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    // Reading the mocap data starts before SDL and the window are set
+    // up, and goes on while the app draws the floor and path.
+    CharacterLoader loader;
+    loader.start();
+    SplineWalker app(&loader, startTime);
     app.run();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,179 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A read-only view of a whole file mapped into memory. The contents
+// stay valid for as long as the MappedFile object is alive.
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+    // Maps the file, replacing any previous mapping. Returns false if
+    // the file could not be opened or mapped.
+    bool open(std::string filename);
+    void close();
+    bool isOpen() const { return begin != NULL; }
+    const char *data() const { return begin; }
+    size_t size() const { return length; }
+protected:
+    MappedFile(const MappedFile&);            // not copyable
+    MappedFile &operator=(const MappedFile&);
+    const char *begin;
+    size_t length;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+};
+
+// Size and last modification time of a file on disk.
+struct FileStatus {
+    unsigned long long size;
+    long long modified; // seconds since the epoch
+};
+
+// Fills in status and returns true if the file exists.
+bool getFileStatus(std::string filename, FileStatus &status);
+
+// Definitions below
+
+// An empty file cannot be mapped, so it is represented by a pointer
+// to this instead.
+static const char emptyMappedFile[1] = {0};
+
+inline bool getFileStatus(std::string filename, FileStatus &status) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    status.size = (unsigned long long)st.st_size;
+    status.modified = (long long)st.st_mtime;
+    return true;
+}
+
+inline MappedFile::MappedFile() {
+    begin = NULL;
+    length = 0;
+#ifdef _WIN32
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+#endif
+}
+
+inline MappedFile::~MappedFile() {
+    close();
+}
+
+#ifdef _WIN32
+
+inline bool MappedFile::open(std::string filename) {
+    close();
+    file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                       NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize)) {
+        close();
+        return false;
+    }
+    length = (size_t)fileSize.QuadPart;
+    if (length == 0) {
+        begin = emptyMappedFile;
+        return true;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        close();
+        return false;
+    }
+    begin = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (begin == NULL) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+inline void MappedFile::close() {
+    if (begin && begin != emptyMappedFile) {
+        UnmapViewOfFile(begin);
+    }
+    if (mapping) {
+        CloseHandle(mapping);
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+    begin = NULL;
+    length = 0;
+}
+
+#else
+
+inline bool MappedFile::open(std::string filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    length = (size_t)st.st_size;
+    if (length == 0) {
+        ::close(fd);
+        begin = emptyMappedFile;
+        return true;
+    }
+    void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps its own reference to the file
+    if (p == MAP_FAILED) {
+        length = 0;
+        return false;
+    }
+    madvise(p, length, MADV_SEQUENTIAL);
+    begin = (const char*)p;
+    return true;
+}
+
+inline void MappedFile::close() {
+    if (begin && begin != emptyMappedFile) {
+        munmap((void*)begin, length);
+    }
+    begin = NULL;
+    length = 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef MAPPED_READER_HPP
+#define MAPPED_READER_HPP
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "mapped_file.hpp"
+
+// A token returned by MappedReader::readToken. It points directly
+// into the reader's buffer instead of copying the characters, so it
+// is only valid while that buffer is.
+class TokenView {
+public:
+    TokenView(): ptr(NULL), len(0) {}
+    TokenView(const char *p, size_t n): ptr(p), len(n) {}
+    const char *data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    std::string str() const { return std::string(ptr, len); }
+    bool operator==(const char *s) const {
+        return std::strncmp(ptr, s, len) == 0 && s[len] == '\0';
+    }
+    bool operator!=(const char *s) const { return !(*this == s); }
+    bool operator==(const TokenView &t) const {
+        return len == t.len && std::memcmp(ptr, t.ptr, len) == 0;
+    }
+protected:
+    const char *ptr;
+    size_t len;
+};
+
+// Drop-in replacement for Reader that scans a block of memory
+// (usually a MappedFile) with plain pointers. It offers the same
+// expect/peek/read* calls with the same end-of-input behaviour, so
+// the ASF/AMC parsers can use either one, but it never copies the
+// input into temporary strings or streams.
+class MappedReader {
+public:
+    MappedReader(const char *begin, const char *end);
+    MappedReader(const MappedFile &file);
+    bool expect(const char *s);
+    bool expect(const std::string &s) { return expect(s.c_str()); }
+    bool peek(const char *s);
+    bool peek(const std::string &s) { return peek(s.c_str()); }
+    void swallowWhitespace();
+    void swallowLine();
+    bool readFloat(float &f);
+    bool readInt(int &i);
+    bool readToken(std::string &s);
+    bool readToken(TokenView &t);
+    bool good();
+    bool readLine(std::string &line);
+    bool upcomingInt();
+    // Current read position, for callers that split the input.
+    const char *position() const { return cur; }
+protected:
+    static bool floatChar(char c);
+    static bool intChar(char c);
+    static bool tokenChar(char c);
+    // Returns the end of the run of characters starting at cur for
+    // which pred holds; running into the end of the input counts as
+    // a failed read, as it does for an istream.
+    const char *scan(bool (*pred)(char));
+    const char *cur;
+    const char *end;
+    bool failed;
+};
+
+// Definitions below
+
+inline MappedReader::MappedReader(const char *begin, const char *end) {
+    cur = begin;
+    this->end = end;
+    failed = false;
+}
+
+inline MappedReader::MappedReader(const MappedFile &file) {
+    cur = file.data();
+    end = file.data() + file.size();
+    failed = !file.isOpen();
+}
+
+inline bool MappedReader::expect(const char *s) {
+    swallowWhitespace();
+    size_t n = std::strlen(s);
+    size_t avail = end - cur;
+    size_t i = 0;
+    while (i < n && i < avail && cur[i] == s[i]) {
+        i++;
+    }
+    if (i == n) {
+        cur += n;
+        return true;
+    }
+    if (i == avail) {
+        failed = true; // ran out of input while still matching
+    }
+    return false;
+}
+
+inline bool MappedReader::peek(const char *s) {
+    swallowWhitespace();
+    size_t n = std::strlen(s);
+    size_t avail = end - cur;
+    if (n > avail) {
+        if (std::memcmp(cur, s, avail) == 0) {
+            failed = true;
+        }
+        return false;
+    }
+    return std::memcmp(cur, s, n) == 0;
+}
+
+inline void MappedReader::swallowWhitespace() {
+    while (cur < end && std::isspace((unsigned char)*cur)) {
+        cur++;
+    }
+    if (cur == end) {
+        failed = true;
+    }
+}
+
+inline void MappedReader::swallowLine() {
+    const char *nl = (const char*)std::memchr(cur, '\n', end - cur);
+    cur = nl ? nl + 1 : end;
+    swallowWhitespace();
+}
+
+inline const char *MappedReader::scan(bool (*pred)(char)) {
+    const char *p = cur;
+    while (p < end && pred(*p)) {
+        p++;
+    }
+    if (p == end) {
+        failed = true;
+    }
+    return p;
+}
+
+inline bool MappedReader::readFloat(float &f) {
+    static const float pow10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                  1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    swallowWhitespace();
+    const char *start = cur;
+    const char *tokenEnd = scan(floatChar);
+    const char *p = start;
+    cur = tokenEnd;
+    // Fast path for plain decimals like "-12.3456": when the digits
+    // fit in a float mantissa and the scale is an exact power of ten,
+    // one division gives the correctly rounded result.
+    bool negative = (p < tokenEnd && *p == '-');
+    if (p < tokenEnd && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    unsigned long mantissa = 0;
+    int digits = 0, scale = 0;
+    bool point = false;
+    for (; p < tokenEnd; p++) {
+        if (*p >= '0' && *p <= '9') {
+            mantissa = mantissa*10 + (*p - '0');
+            digits++;
+            scale += point;
+            if (mantissa >= (1ul << 24)) {
+                break;
+            }
+        } else if (*p == '.' && !point) {
+            point = true;
+        } else {
+            break;
+        }
+    }
+    if (p == tokenEnd && digits > 0 && scale <= 10) {
+        float value = (float)mantissa / pow10[scale];
+        f = negative ? -value : value;
+        return true;
+    }
+    // Exponents, long mantissas and malformed input go through the
+    // C library like the stream-based Reader does.
+    char buffer[64];
+    size_t n = tokenEnd - start;
+    if (n >= sizeof(buffer)) {
+        n = sizeof(buffer) - 1;
+    }
+    std::memcpy(buffer, start, n);
+    buffer[n] = '\0';
+    f = std::strtof(buffer, NULL);
+    return true;
+}
+
+inline bool MappedReader::readInt(int &i) {
+    swallowWhitespace();
+    const char *tokenEnd = scan(intChar);
+    const char *p = cur;
+    cur = tokenEnd;
+    bool negative = (p < tokenEnd && *p == '-');
+    if (negative) {
+        p++;
+    }
+    int value = 0;
+    while (p < tokenEnd && *p >= '0' && *p <= '9') {
+        value = value*10 + (*p - '0');
+        p++;
+    }
+    i = negative ? -value : value;
+    return true;
+}
+
+inline bool MappedReader::readToken(TokenView &t) {
+    swallowWhitespace();
+    const char *tokenEnd = scan(tokenChar);
+    t = TokenView(cur, tokenEnd - cur);
+    cur = tokenEnd;
+    return true;
+}
+
+inline bool MappedReader::readToken(std::string &s) {
+    TokenView t;
+    readToken(t);
+    s.assign(t.data(), t.size());
+    return true;
+}
+
+inline bool MappedReader::good() {
+    return !failed;
+}
+
+inline bool MappedReader::readLine(std::string &line) {
+    if (cur == end) {
+        failed = true;
+        line.clear();
+        return true;
+    }
+    const char *nl = (const char*)std::memchr(cur, '\n', end - cur);
+    const char *lineEnd = nl ? nl : end;
+    line.assign(cur, lineEnd - cur);
+    cur = nl ? nl + 1 : end;
+    return true;
+}
+
+inline bool MappedReader::upcomingInt() {
+    swallowWhitespace();
+    return cur < end && intChar(*cur);
+}
+
+inline bool MappedReader::floatChar(char c) {
+    return ( c == 'e'
+             || (c >= '0' && c <= '9')
+             || c == '.'
+             || c == '+'
+             || c == '-'
+             );
+}
+
+inline bool MappedReader::intChar(char c) {
+    return ( (c >= '0' && c <= '9') || c == '-');
+}
+
+inline bool MappedReader::tokenChar(char c) {
+    return !std::isspace((unsigned char)c);
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef POSE_HPP
+#define POSE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "cmu_topology.hpp"
+#include "forward_step.hpp"
+#include "skeleton.hpp"
+
+// Where every bone of a skeleton is for one frame, worked out once in a
+// single pass over the bones so that anything that needs joints
+// (drawing, picking, contacts, export) reads them from here instead of
+// deriving them again.
+//
+// Bone b starts at its parent's end (or at the root) and world[b] is
+// its coordinate frame there, with its joint rotation applied: the
+// bone runs from world[b] * (0,0,0) to world[b] * boneVector[b], which
+// is end[b]. "World" is whatever space the root transform puts the
+// skeleton in.
+//
+// Only rotations and translations are involved, so joint rotations are
+// kept as quaternions and coordinate frames as 3x4 affine matrices
+// (glm::mat4x3: three basis columns and the origin); make a mat4 of
+// one with glm::mat4(world[b]) where OpenGL wants it.
+class Pose {
+public:
+    Pose() : root(1.f) {
+        lastUpdate.bones = lastUpdate.rotations = lastUpdate.joints = 0;
+    }
+
+    // Computes the pose of a frame of channel values (in the layout
+    // of skeleton.getLayout()).
+    void evaluate(const Skeleton &skeleton, const glm::mat4x3 &root, const float *frame);
+
+    // The same, starting from the pose this already holds (of the same
+    // skeleton): only bones whose channels moved by more than epsilon
+    // since they were last computed get a new rotation, and only they
+    // and the bones below them a new world frame. A skipped bone keeps
+    // its old channel values in channels, so that slow drift still
+    // adds up to a change. With epsilon 0 the result is exactly that
+    // of evaluate().
+    //
+    // This pays off for held or slowly changing frames with a fixed
+    // root, e.g. a paused character or analysis in skeleton space. A
+    // new root moves every bone, and it is cheaper to compute all of
+    // them than to compare, so then, and when more than half the
+    // channels have changed, update() just calls evaluate(). Playback,
+    // where the root moves on every frame, uses evaluate().
+    void update(const Skeleton &skeleton, const glm::mat4x3 &root, const float *frame,
+                float epsilon = 0.f);
+
+    // What the last update() did, out of how many bones.
+    struct UpdateCounts {
+        int bones;
+        int rotations;      // decoded again
+        int joints;         // world frame and end computed again
+    };
+    UpdateCounts lastUpdate;
+
+    // World frames and bone ends from local rotations, one bone after
+    // the other for any hierarchy. evaluate() uses this, or
+    // CmuTopology::forward() when the skeleton has the CMU hierarchy.
+    static void forward(const Skeleton &skeleton, const glm::mat4x3 &root, const glm::quat *local,
+                        glm::mat4x3 *world, glm::vec3 *end);
+
+    int boneCount() const { return (int)world.size(); }
+
+    glm::mat4x3 root;
+    std::vector<float> channels;        // the frame the pose was computed from
+    std::vector<glm::quat> local;       // per bone, in skeleton order, relative to its parent
+    std::vector<glm::mat4x3> world;     // per bone
+    std::vector<glm::vec3> end;         // per bone, the joint at its end
+
+protected:
+    // Per bone, for update(): whether its rotation or its frame has
+    // to be computed again.
+    std::vector<uint8_t> changed;
+    std::vector<uint8_t> dirty;
+};
+
+// Definitions below
+
+inline void Pose::evaluate(const Skeleton &skeleton, const glm::mat4x3 &root, const float *frame) {
+    int n = skeleton.boneCount();
+    this->root = root;
+    channels.assign(frame, frame + skeleton.getLayout().frameSize);
+    local.resize(n);
+    world.resize(n);
+    end.resize(n);
+    skeleton.localRotations(frame, local.data());
+    if (skeleton.hasCmuTopology()) {
+        CmuTopology::forward(root, local.data(), skeleton.boneVector.data(), world.data(), end.data());
+    } else {
+        forward(skeleton, root, local.data(), world.data(), end.data());
+    }
+}
+
+inline void Pose::update(const Skeleton &skeleton, const glm::mat4x3 &root, const float *frame,
+                         float epsilon) {
+    int n = skeleton.boneCount();
+    if ((int)world.size() != n || (int)channels.size() != skeleton.getLayout().frameSize) {
+        evaluate(skeleton, root, frame);
+        lastUpdate.bones = lastUpdate.rotations = lastUpdate.joints = n;
+        return;
+    }
+    if (root != this->root) {
+        evaluate(skeleton, root, frame);
+        lastUpdate.bones = lastUpdate.rotations = lastUpdate.joints = n;
+        return;
+    }
+    // One pass over the channels first, with no branches, so that a
+    // frame where most of them moved goes to evaluate() right away.
+    int frameSize = (int)channels.size(), moving = 0;
+    for (int c = ChannelLayout::rootChannels; c < frameSize; c++) {
+        moving += std::abs(frame[c] - channels[c]) > epsilon;
+    }
+    if (2*moving > frameSize - ChannelLayout::rootChannels) {
+        evaluate(skeleton, root, frame);
+        lastUpdate.bones = lastUpdate.rotations = lastUpdate.joints = n;
+        return;
+    }
+    std::copy(frame, frame + ChannelLayout::rootChannels, channels.begin());
+    changed.resize(n);
+    dirty.resize(n);
+    lastUpdate.bones = n;
+    lastUpdate.rotations = 0;
+    int dirtyCount = 0;
+    for (int b = 0; b < n; b++) {
+        int first = skeleton.channelOffset[b];
+        int mask = skeleton.dofMask[b];
+        int count = (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1);
+        bool bone = false;
+        for (int c = first; c < first + count; c++) {
+            bone = bone || std::abs(frame[c] - channels[c]) > epsilon;
+        }
+        if (bone) {
+            std::copy(frame + first, frame + first + count, channels.begin() + first);
+            lastUpdate.rotations++;
+        }
+        changed[b] = bone;
+        int parent = skeleton.parent[b];
+        dirty[b] = bone || (parent >= 0 && dirty[parent]);
+        dirtyCount += dirty[b];
+    }
+    skeleton.localRotations(frame, local.data(), changed.data());
+    // Going over the clean bones again gives them the same frames, so
+    // when most are dirty the unrolled pass over all of them is faster.
+    if (skeleton.hasCmuTopology() && 2*dirtyCount > n) {
+        CmuTopology::forward(root, local.data(), skeleton.boneVector.data(), world.data(), end.data());
+        lastUpdate.joints = n;
+        return;
+    }
+    for (int b = 0; b < n; b++) {
+        if (dirty[b]) {
+            int parent = skeleton.parent[b];
+            forwardStep(parent < 0 ? root : world[parent], parent < 0 ? root[3] : end[parent],
+                        local[b], skeleton.boneVector[b], world[b], end[b]);
+        }
+    }
+    lastUpdate.joints = dirtyCount;
+}
+
+inline void Pose::forward(const Skeleton &skeleton, const glm::mat4x3 &root, const glm::quat *local,
+                          glm::mat4x3 *world, glm::vec3 *end) {
+    for (int b = 0; b < skeleton.boneCount(); b++) {
+        int parent = skeleton.parent[b];
+        forwardStep(parent < 0 ? root : world[parent], parent < 0 ? root[3] : end[parent], local[b],
+                    skeleton.boneVector[b], world[b], end[b]);
+    }
+}
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef SKELETON_HPP
+#define SKELETON_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "clip.hpp"
+#include "clip_cache.hpp"
+#include "cmu_topology.hpp"
+#include "dof_decoder.hpp"
+#include "euler_kernel.hpp"
+
+// The bones of a character, flattened into arrays. Bones are numbered
+// in depth-first order of the hierarchy, so every bone comes after its
+// parent and one pass from first to last visits the whole tree: that
+// is how forward kinematics, drawing and export walk it.
+//
+// What is needed every frame (parents, bone vectors, bind rotations,
+// dof masks, channel offsets and limits) is kept in separate
+// contiguous arrays; names and the other values only needed when
+// loading or saving are kept apart in BoneInfo.
+//
+// Frames keep the channel order of the ASF file (getLayout()), which
+// is not the bone order here; channelOffset connects the two.
+//
+// Nothing per frame is kept here (that is in Pose), so once finished a
+// skeleton does not change, and a Character holds it by
+// shared_ptr<const Skeleton>, shared by all instances of the character.
+class Skeleton {
+public:
+    // What a bone is, as read from the ASF file.
+    struct BoneInfo {
+        std::string name;
+        int id;
+        glm::vec3 direction;
+        float length;          // in meters
+        glm::vec3 axis;        // bind rotation, degrees, XYZ order
+        int asfIndex;          // position in the ASF :bonedata section
+    };
+
+    Skeleton() : cmuTopology(false) {}
+
+    // Bones are added in ASF order, then linked, then finish() puts
+    // them in hierarchy order. addBone() returns the bone's ASF index,
+    // which is what addLink() and, until finish(), findBone() use.
+    // dofMask has bit 0 for rx, 1 for ry, 2 for rz; limits holds the
+    // min and max of each.
+    int addBone(const BoneInfo &info, int dofMask, const float *limits);
+    // parent = -1 attaches child to the root.
+    void addLink(int parent, int child);
+    void finish();
+
+    // Builds the skeleton from the records of a cache or database.
+    void fromRecords(const ClipCache::BoneRecord *records, int boneCount,
+                     const ClipCache::Link *links, int linkCount);
+    // The records of a cache: bones in ASF order, and the hierarchy.
+    // Returns false if a bone name does not fit.
+    bool toRecords(std::vector<ClipCache::BoneRecord> &records,
+                   std::vector<ClipCache::Link> &links) const;
+
+    int boneCount() const { return (int)parent.size(); }
+    bool empty() const { return parent.empty(); }
+    // Index of the named bone, or -1.
+    int findBone(const std::string &name) const;
+    const BoneInfo &getInfo(int b) const { return info[b]; }
+    const ChannelLayout &getLayout() const { return layout; }
+    // Whether the hierarchy is that of the CMU skeletons
+    // (cmu_topology.hpp), for which FK has an unrolled path.
+    bool hasCmuTopology() const { return cmuTopology; }
+
+    // The rx, ry and rz of every bone (0 for the ones it does not
+    // have) in a frame of channel values, 3 per bone.
+    void decodeAngles(const float *frame, float *angles) const;
+
+    // Rotation of bone b relative to its parent for a frame of
+    // channel values.
+    glm::quat localRotation(int b, const float *frame) const;
+    // The same for every bone at once, through the batched kernel
+    // (euler_kernel.hpp); local has boneCount() entries per frame.
+    void localRotations(const float *frame, glm::quat *local) const;
+    void localRotations(const float *frames, int frameCount, glm::quat *local) const;
+    // Only the bones b with changed[b] set.
+    void localRotations(const float *frame, glm::quat *local, const uint8_t *changed) const;
+
+    // Per bone, in hierarchy order.
+    std::vector<int> parent;                    // -1 for bones on the root
+    std::vector<glm::vec3> boneVector;          // length*direction
+    std::vector<glm::quat> bindRotation;        // from the ASF axis
+    std::vector<uint8_t> dofMask;
+    std::vector<DofDecode> decoder;             // for the dofMask, set by finish()
+    std::vector<int> channelOffset;             // of the bone's first dof
+    std::vector<float> limits;                  // 6 per bone
+
+protected:
+    std::vector<BoneInfo> info;
+    std::vector<std::pair<int, int> > links;    // ASF indices, while building
+    std::map<std::string, int> names;
+    ChannelLayout layout;
+    EulerKernel kernel;     // set up by finish()
+    bool cmuTopology;
+};
+
+// Definitions below
+
+inline int Skeleton::addBone(const BoneInfo &info, int dofMask, const float *limits) {
+    int b = (int)this->info.size();
+    this->info.push_back(info);
+    this->info.back().asfIndex = b;
+    names[info.name] = b;
+    int dofs = (dofMask & 1) + ((dofMask >> 1) & 1) + ((dofMask >> 2) & 1);
+    channelOffset.push_back(layout.frameSize);
+    layout.addBone(info.name, dofs);
+    parent.push_back(-1);
+    boneVector.push_back(info.length*info.direction);
+    bindRotation.push_back(quaternionZYX(info.axis.z, info.axis.y, info.axis.x));
+    this->dofMask.push_back((uint8_t)dofMask);
+    this->limits.insert(this->limits.end(), limits, limits + 6);
+    return b;
+}
+
+inline void Skeleton::addLink(int parent, int child) {
+    links.push_back(std::make_pair(parent, child));
+}
+
+inline void Skeleton::finish() {
+    int n = (int)info.size();
+    std::vector<std::vector<int> > children(n);
+    std::vector<int> roots, asfParent(n, -1);
+    std::vector<char> attached(n, 0);
+    for (size_t l = 0; l < links.size(); l++) {
+        int p = links[l].first, c = links[l].second;
+        if (p < 0) {
+            roots.push_back(c);
+        } else {
+            children[p].push_back(c);
+        }
+        asfParent[c] = p;
+        attached[c] = 1;
+    }
+    links.clear();
+    // Bones the hierarchy never mentions hang off the root.
+    for (int a = 0; a < n; a++) {
+        if (!attached[a]) {
+            roots.push_back(a);
+        }
+    }
+    // Depth first, children in the order they were linked.
+    std::vector<int> order, stack(roots.rbegin(), roots.rend());
+    std::vector<char> visited(n, 0);
+    while (!stack.empty()) {
+        int a = stack.back();
+        stack.pop_back();
+        if (visited[a]) {
+            continue;
+        }
+        visited[a] = 1;
+        order.push_back(a);
+        for (int i = (int)children[a].size() - 1; i >= 0; i--) {
+            stack.push_back(children[a][i]);
+        }
+    }
+    std::vector<int> position(n, -1);
+    for (int b = 0; b < (int)order.size(); b++) {
+        position[order[b]] = b;
+    }
+
+    Skeleton sorted;
+    sorted.layout = layout;
+    for (int b = 0; b < (int)order.size(); b++) {
+        int a = order[b];
+        sorted.info.push_back(info[a]);
+        sorted.names[info[a].name] = b;
+        sorted.parent.push_back(asfParent[a] < 0 ? -1 : position[asfParent[a]]);
+        sorted.boneVector.push_back(boneVector[a]);
+        sorted.bindRotation.push_back(bindRotation[a]);
+        sorted.dofMask.push_back(dofMask[a]);
+        sorted.channelOffset.push_back(channelOffset[a]);
+        sorted.limits.insert(sorted.limits.end(), &limits[6*a], &limits[6*a] + 6);
+    }
+    *this = sorted;
+
+    for (int b = 0; b < (int)order.size(); b++) {
+        decoder.push_back(dofDecoder(dofMask[b]));
+    }
+    kernel.setJoints((int)order.size(), decoder.data(), channelOffset.data(), bindRotation.data());
+    cmuTopology = CmuTopology::matches((int)order.size(), parent.data(), dofMask.data());
+}
+
+inline void Skeleton::fromRecords(const ClipCache::BoneRecord *records, int boneCount,
+                                  const ClipCache::Link *links, int linkCount) {
+    for (int b = 0; b < boneCount; b++) {
+        const ClipCache::BoneRecord &rec = records[b];
+        BoneInfo bone;
+        bone.name = std::string(rec.name, strnlen(rec.name, sizeof(rec.name)));
+        bone.id = rec.id;
+        bone.direction = glm::vec3(rec.direction[0], rec.direction[1], rec.direction[2]);
+        bone.length = rec.length;
+        bone.axis = glm::vec3(rec.axis[0], rec.axis[1], rec.axis[2]);
+        addBone(bone, (int)rec.dofMask, rec.limits);
+    }
+    for (int l = 0; l < linkCount; l++) {
+        addLink(links[l].parent, links[l].child);
+    }
+    finish();
+}
+
+inline bool Skeleton::toRecords(std::vector<ClipCache::BoneRecord> &records,
+                                std::vector<ClipCache::Link> &links) const {
+    int n = boneCount();
+    records.assign(n, ClipCache::BoneRecord());
+    links.clear();
+    std::vector<std::vector<int> > children(n); // ASF indices
+    for (int b = 0; b < n; b++) {
+        const BoneInfo &bone = info[b];
+        ClipCache::BoneRecord &rec = records[bone.asfIndex];
+        std::memset(&rec, 0, sizeof(rec));
+        if (bone.name.size() >= sizeof(rec.name)) {
+            std::cerr << "Bone name '" << bone.name << "' too long to cache" << std::endl;
+            return false;
+        }
+        std::memcpy(rec.name, bone.name.c_str(), bone.name.size());
+        rec.id = bone.id;
+        for (int i = 0; i < 3; i++) {
+            rec.direction[i] = bone.direction[i];
+            rec.axis[i] = bone.axis[i];
+        }
+        rec.length = bone.length;
+        rec.dofMask = dofMask[b];
+        std::memcpy(rec.limits, &limits[6*b], sizeof(rec.limits));
+        if (parent[b] < 0) {
+            ClipCache::Link link = {-1, bone.asfIndex};
+            links.push_back(link);
+        } else {
+            children[info[parent[b]].asfIndex].push_back(bone.asfIndex);
+        }
+    }
+    for (int a = 0; a < n; a++) {
+        for (size_t i = 0; i < children[a].size(); i++) {
+            ClipCache::Link link = {a, children[a][i]};
+            links.push_back(link);
+        }
+    }
+    return true;
+}
+
+inline int Skeleton::findBone(const std::string &name) const {
+    std::map<std::string, int>::const_iterator it = names.find(name);
+    return it == names.end() ? -1 : it->second;
+}
+
+inline void Skeleton::decodeAngles(const float *frame, float *angles) const {
+    for (int b = 0; b < boneCount(); b++) {
+        decoder[b](frame + channelOffset[b], angles + 3*b);
+    }
+}
+
+inline glm::quat Skeleton::localRotation(int b, const float *frame) const {
+    float angles[3];
+    decoder[b](frame + channelOffset[b], angles);
+    return bindRotation[b] * quaternionZYX(angles[2], angles[1], angles[0])
+        * glm::conjugate(bindRotation[b]);
+}
+
+inline void Skeleton::localRotations(const float *frame, glm::quat *local) const {
+    kernel.decode(frame, local);
+}
+
+inline void Skeleton::localRotations(const float *frames, int frameCount, glm::quat *local) const {
+    kernel.decode(frames, frameCount, layout.frameSize, local);
+}
+
+inline void Skeleton::localRotations(const float *frame, glm::quat *local, const uint8_t *changed) const {
+    kernel.decode(frame, local, changed);
+}
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef STREAMED_CLIP_HPP
+#define STREAMED_CLIP_HPP
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "clip.hpp"
+#include "frame_source.hpp"
+#include "mapped_reader.hpp"
+
+// Byte offsets of the frames of an AMC file, found in one pass over
+// the file. Frame f occupies [offsets[f], offsets[f+1]), starting
+// with its frame-number line.
+class FrameIndex {
+public:
+    // Scans the file. Returns false if it could not be read.
+    bool build(std::string amcFilename);
+    int frameCount() const { return offsets.empty() ? 0 : (int)offsets.size() - 1; }
+    std::vector<unsigned long long> offsets;
+};
+
+// Plays an AMC file from disk without decoding all of it up front.
+// Only the frame index is kept in memory; each requested frame is
+// read with a single seek and decoded on its own, so seeking costs
+// the same no matter how far away the frame is.
+class StreamedClip : public FrameSource {
+public:
+    StreamedClip();
+    // Builds the index and learns the channel schema from the first
+    // frame. Returns false if the file has no frames.
+    bool open(std::string amcFilename, const ChannelLayout &layout);
+    int frameCount() const { return index.frameCount(); }
+    const ChannelLayout &getLayout() const { return layout; }
+    const float *frame(int f) const;
+    bool randomAccess() const { return false; }
+    const FrameIndex &getIndex() const { return index; }
+protected:
+    FrameIndex index;
+    ChannelLayout layout;
+    mutable ChannelSchema schema; // learned when frame 0 is first read
+    mutable std::ifstream in;
+    mutable std::vector<char> buffer;
+    mutable std::vector<float> values;
+    mutable int currentFrame; // frame held in values, -1 if none
+};
+
+// Definitions below
+
+inline bool FrameIndex::build(std::string amcFilename) {
+    offsets.clear();
+    std::ifstream in(amcFilename.c_str(), std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    // Frames start at the lines that begin with a digit; header and
+    // bone lines begin with '#', ':' or a letter.
+    std::vector<char> block(1 << 20);
+    unsigned long long blockStart = 0;
+    bool lineStart = true;
+    while (in) {
+        in.read(block.data(), block.size());
+        size_t n = (size_t)in.gcount();
+        if (n == 0) {
+            break;
+        }
+        const char *p = block.data(), *end = block.data() + n;
+        while (p < end) {
+            if (lineStart && *p >= '0' && *p <= '9') {
+                offsets.push_back(blockStart + (p - block.data()));
+            }
+            const char *nl = (const char*)std::memchr(p, '\n', end - p);
+            if (!nl) {
+                lineStart = false;
+                break;
+            }
+            p = nl + 1;
+            lineStart = true;
+        }
+        blockStart += n;
+    }
+    if (!offsets.empty()) {
+        offsets.push_back(blockStart);
+    }
+    return true;
+}
+
+inline StreamedClip::StreamedClip() {
+    currentFrame = -1;
+}
+
+inline bool StreamedClip::open(std::string amcFilename, const ChannelLayout &layout) {
+    this->layout = layout;
+    schema = ChannelSchema();
+    currentFrame = -1;
+    if (!index.build(amcFilename)) {
+        return false;
+    }
+    in.close();
+    in.clear();
+    in.open(amcFilename.c_str(), std::ios::binary);
+    if (index.frameCount() == 0) {
+        return false;
+    }
+    frame(0); // learns the schema
+    return !schema.empty();
+}
+
+inline const float *StreamedClip::frame(int f) const {
+    if (f == currentFrame) {
+        return values.data();
+    }
+    unsigned long long begin = index.offsets[f], end = index.offsets[f+1];
+    buffer.resize((size_t)(end - begin));
+    in.clear();
+    in.seekg((std::streamoff)begin);
+    in.read(buffer.data(), buffer.size());
+    MappedReader r(buffer.data(), buffer.data() + (size_t)in.gcount());
+    values.clear();
+    if (AnimationClip::parseFrames(r, layout, schema, values, 1) == 0) {
+        values.assign(layout.frameSize, 0.f); // incomplete last frame
+    }
+    currentFrame = f;
+    return values.data();
+}
+
+#endif